@@ -8,8 +8,10 @@
 #	include "config.h"
 #endif
 
+#include <algorithm>
 #include <cstring>
 #include <stdexcept>
+#include <vector>
 
 #ifdef ENABLE_LZO
 #	include <lzo/lzo1x.h>
@@ -18,6 +20,15 @@
 #	include <lz4.h>
 #	include <lz4hc.h>
 #endif
+#ifdef ENABLE_ZSTD
+#	include <zstd.h>
+#endif
+#ifdef ENABLE_XZ
+#	include <lzma.h>
+#endif
+#ifdef ENABLE_ZLIB
+#	include <zlib.h>
+#endif
 
 #include "compressor.hxx"
 
@@ -27,6 +38,9 @@ namespace compressor_id
 	{
 		lzo = 0x01 << 24,
 		lz4 = 0x02 << 24,
+		zstd = 0x03 << 24,
+		xz = 0x04 << 24,
+		zlib = 0x05 << 24,
 		mask = 0xff << 24
 	};
 }
@@ -39,6 +53,16 @@ void Compressor::reset()
 {
 }
 
+void Compressor::detect(const std::vector<std::vector<char> >& samples,
+		size_t out_size)
+{
+	std::vector<char> buf(out_size);
+
+	for (std::vector<std::vector<char> >::const_iterator
+			i = samples.begin(); i != samples.end(); ++i)
+		decompress(&buf.front(), &(*i).front(), (*i).size(), out_size);
+}
+
 #ifdef ENABLE_LZO
 
 namespace lzo_options
@@ -78,8 +102,7 @@ namespace lzo
 #pragma pack(pop)
 
 LZOCompressor::LZOCompressor()
-	: compression_level(8), optimized(true), // default
-	optimized_tested(false)
+	: compression_level(8), optimized(true) // default
 {
 	if (lzo_init() != LZO_E_OK)
 		throw std::runtime_error("lzo_init() failed");
@@ -102,9 +125,98 @@ void LZOCompressor::setup(MetadataReader* coptsr)
 	}
 }
 
-void LZOCompressor::reset()
+namespace lzo
+{
+	namespace sample_result
+	{
+		enum sample_result
+		{
+			// re-compressed data matches and optimization is a no-op
+			indeterminate,
+			plain,
+			optimized,
+			mismatch
+		};
+	}
+
+	// the buffers are reused by each thread between the samples
+	struct workspace
+	{
+		std::vector<char> wrkmem;
+		std::vector<unsigned char> dbuf, cbuf, obuf;
+	};
+
+	static thread_local workspace ws;
+}
+
+void LZOCompressor::detect(const std::vector<std::vector<char> >& samples,
+		size_t out_size)
 {
-	optimized_tested = false;
+	std::vector<int> results(samples.size());
+	int level = compression_level;
+
+	parallel_for(samples.size(), [&](size_t i)
+	{
+		const unsigned char* src
+			= reinterpret_cast<const unsigned char*>(&samples[i].front());
+		lzo_uint length = samples[i].size();
+
+		lzo::ws.wrkmem.resize(LZO1X_999_MEM_COMPRESS);
+		lzo::ws.dbuf.resize(out_size);
+		lzo::ws.obuf.resize(length);
+
+		lzo_uint out_bytes = out_size;
+		if (lzo1x_decompress_safe(src, length, &lzo::ws.dbuf.front(),
+					&out_bytes, 0) != LZO_E_OK)
+			throw std::runtime_error("LZO decompression failed (corrupted data?)");
+
+		// lzo1x_999 does not limit the output size (the output of
+		// a block that does not reproduce may be longer than it)
+		lzo_uint comp_bytes = out_bytes + out_bytes / 16 + 64 + 3;
+		lzo::ws.cbuf.resize(comp_bytes);
+		if (lzo1x_999_compress_level(&lzo::ws.dbuf.front(), out_bytes,
+					&lzo::ws.cbuf.front(), &comp_bytes,
+					&lzo::ws.wrkmem.front(), 0, 0, 0, level) != LZO_E_OK)
+			throw std::runtime_error("LZO test re-compression failed");
+		if (comp_bytes != length)
+		{
+			results[i] = lzo::sample_result::mismatch;
+			return;
+		}
+
+		// optimize a copy, decompressing into the (now unused) buffer
+		lzo_uint opt_bytes = out_size;
+		memcpy(&lzo::ws.obuf.front(), &lzo::ws.cbuf.front(), length);
+		if (lzo1x_optimize(&lzo::ws.obuf.front(), length,
+					&lzo::ws.dbuf.front(), &opt_bytes, 0) != LZO_E_OK)
+			throw std::runtime_error("LZO test re-optimization failed");
+
+		bool plain_match = !memcmp(src, &lzo::ws.cbuf.front(), length);
+		bool opt_match = !memcmp(src, &lzo::ws.obuf.front(), length);
+
+		if (plain_match && opt_match)
+			results[i] = lzo::sample_result::indeterminate;
+		else if (plain_match)
+			results[i] = lzo::sample_result::plain;
+		else if (opt_match)
+			results[i] = lzo::sample_result::optimized;
+		else
+			results[i] = lzo::sample_result::mismatch;
+	});
+
+	// use the first conclusive sample, to keep the result independent
+	// of the thread scheduling; the samples that do not reproduce either
+	// way are skipped (and kept verbatim by the verification later),
+	// and the default is kept if none is conclusive
+	for (std::vector<int>::iterator i = results.begin();
+			i != results.end(); ++i)
+	{
+		if (*i != lzo::sample_result::indeterminate)
+		{
+			optimized = (*i == lzo::sample_result::optimized);
+			break;
+		}
+	}
 }
 
 size_t LZOCompressor::decompress(void* dest, const void* src,
@@ -118,64 +230,39 @@ size_t LZOCompressor::decompress(void* dest, const void* src,
 	if (lzo1x_decompress_safe(src2, length, dest2, &out_bytes, 0) != LZO_E_OK)
 		throw std::runtime_error("LZO decompression failed (corrupted data?)");
 
-	// check whether the output was optimized
-	if (!optimized_tested)
-	{
-		int ret, ret2;
-
-		char workspace[LZO1X_999_MEM_COMPRESS];
-		unsigned char* cbuf = new unsigned char[length];
-		lzo_uint comp_bytes = length;
-
-		ret = lzo1x_999_compress_level(dest2, out_bytes, cbuf, &comp_bytes,
-					workspace, 0, 0, 0, compression_level);
-
-		if (ret == LZO_E_OK && comp_bytes == length)
-		{
-			unsigned char* obuf = new unsigned char[length];
-			unsigned char* ibuf = new unsigned char[out_bytes];
-
-			lzo_uint out_bytes2 = out_bytes;
-
-			memcpy(obuf, cbuf, length);
-			ret2 = lzo1x_optimize(obuf, length, ibuf, &out_bytes2, 0);
-
-			// first of all, check whether optimization changes anything
-			// if it does not, we need to try on another block
-			if (memcmp(obuf, cbuf, length))
-			{
-				// we assume the output was optimized if we get the same
-				// result after re-compressing and optimizing
-				optimized = !memcmp(src, obuf, length);
-
-				optimized_tested = true;
-			}
+	return out_bytes;
+}
 
-			delete[] ibuf;
-			delete[] obuf;
-		}
+size_t LZOCompressor::compress(void* dest, const void* src,
+		size_t length, size_t out_size) const
+{
+	// lzo1x_999 does not limit the output size
+	lzo_uint comp_bytes = length + length / 16 + 64 + 3;
 
-		// if it was not optimized, we should get the same result
-		// as for plain compression. otherwise, raise an exception
-		if (!optimized && memcmp(src, cbuf, length))
-		{
-			delete[] cbuf;
+	lzo::ws.wrkmem.resize(LZO1X_999_MEM_COMPRESS);
+	lzo::ws.cbuf.resize(comp_bytes);
+	lzo::ws.dbuf.resize(length);
 
-			throw std::runtime_error("Input compressed data does not match"
-					" re-compressed optimized nor non-optimized data");
-		}
+	if (lzo1x_999_compress_level(static_cast<const unsigned char*>(src),
+				length, &lzo::ws.cbuf.front(), &comp_bytes,
+				&lzo::ws.wrkmem.front(), 0, 0, 0,
+				compression_level) != LZO_E_OK)
+		throw std::runtime_error("LZO re-compression failed");
 
-		delete[] cbuf;
+	if (optimized)
+	{
+		lzo_uint out_bytes = length;
 
-		if (ret != LZO_E_OK)
-			throw std::runtime_error("LZO test re-compression failed");
-		if (comp_bytes != length)
-			throw std::runtime_error("LZO test re-compression resulted in different size");
-		if (ret2 != LZO_E_OK)
-			throw std::runtime_error("LZO test re-optimization failed");
+		if (lzo1x_optimize(&lzo::ws.cbuf.front(), comp_bytes,
+					&lzo::ws.dbuf.front(), &out_bytes, 0) != LZO_E_OK)
+			throw std::runtime_error("LZO re-optimization failed");
 	}
 
-	return out_bytes;
+	if (comp_bytes > out_size)
+		return 0;
+
+	memcpy(dest, &lzo::ws.cbuf.front(), comp_bytes);
+	return comp_bytes;
 }
 
 uint32_t LZOCompressor::get_compression_value() const
@@ -273,6 +360,22 @@ size_t LZ4Compressor::decompress(void* dest, const void* src,
 	return out;
 }
 
+size_t LZ4Compressor::compress(void* dest, const void* src,
+		size_t length, size_t out_size) const
+{
+	const char* src2 = static_cast<const char*>(src);
+	char* dest2 = static_cast<char*>(dest);
+	int out;
+
+	// (level 0 means the default, as used by mksquashfs)
+	if (hc)
+		out = LZ4_compress_HC(src2, dest2, length, out_size, 0);
+	else
+		out = LZ4_compress_default(src2, dest2, length, out_size);
+
+	return out > 0 ? out : 0;
+}
+
 uint32_t LZ4Compressor::get_compression_value() const
 {
 	uint32_t ret = compressor_id::lz4;
@@ -284,3 +387,620 @@ uint32_t LZ4Compressor::get_compression_value() const
 }
 
 #endif /*ENABLE_LZ4*/
+
+#ifdef ENABLE_ZSTD
+
+namespace zstd_options
+{
+	enum zstd_options
+	{
+		level_mask = 0xff
+	};
+}
+
+#pragma pack(push, 1)
+namespace zstd
+{
+	struct comp_options
+	{
+		le32 compression_level;
+	};
+
+	// mksquashfs default
+	const int default_level = 15;
+
+	// how many blocks to test when detecting the level
+	const int max_tested_blocks = 8;
+}
+#pragma pack(pop)
+
+ZstdCompressor::ZstdCompressor()
+	: compression_level(zstd::default_level), level_tested(false),
+	tested_blocks(0), dctx(0), cctx(0)
+{
+	dctx = ZSTD_createDCtx();
+	cctx = ZSTD_createCCtx();
+
+	if (!dctx || !cctx)
+	{
+		ZSTD_freeDCtx(dctx);
+		ZSTD_freeCCtx(cctx);
+		throw std::bad_alloc();
+	}
+}
+
+ZstdCompressor::~ZstdCompressor()
+{
+	ZSTD_freeDCtx(dctx);
+	ZSTD_freeCCtx(cctx);
+}
+
+void ZstdCompressor::setup(MetadataReader* coptsr)
+{
+	if (coptsr)
+	{
+		const struct zstd::comp_options& opts
+			= coptsr->read<struct zstd::comp_options>();
+
+		if (opts.compression_level < 1
+				|| opts.compression_level
+				> static_cast<uint32_t>(ZSTD_maxCLevel()))
+			throw std::runtime_error("Invalid compression level specified");
+
+		compression_level = opts.compression_level;
+	}
+}
+
+void ZstdCompressor::reset()
+{
+	level_tested = false;
+	tested_blocks = 0;
+}
+
+void ZstdCompressor::test_level(const void* dest, size_t out_bytes,
+		const void* src, size_t length)
+{
+	std::vector<char> cbuf(ZSTD_compressBound(out_bytes));
+
+	if (tested_blocks == 0)
+	{
+		candidate_levels.clear();
+		for (int level = 1; level <= ZSTD_maxCLevel(); ++level)
+			candidate_levels.push_back(level);
+	}
+
+	// different levels commonly give the same output (especially
+	// for small blocks), so narrow the candidates down over a few
+	// blocks
+	std::vector<int> left;
+	for (std::vector<int>::iterator i = candidate_levels.begin();
+			i != candidate_levels.end(); ++i)
+	{
+		size_t ret = ZSTD_compressCCtx(cctx, &cbuf.front(), cbuf.size(),
+				dest, out_bytes, *i);
+
+		if (!ZSTD_isError(ret) && ret == length
+				&& !memcmp(&cbuf.front(), src, length))
+			left.push_back(*i);
+	}
+
+	// a block that no candidate reproduces is skipped; it will be
+	// kept verbatim by the verification
+	if (!left.empty())
+		candidate_levels.swap(left);
+
+	++tested_blocks;
+	if (candidate_levels.size() == 1
+			|| tested_blocks >= zstd::max_tested_blocks)
+	{
+		// prefer the level from the options if it still matches
+		if (std::find(candidate_levels.begin(), candidate_levels.end(),
+					compression_level) == candidate_levels.end())
+			compression_level = candidate_levels.front();
+		level_tested = true;
+	}
+}
+
+size_t ZstdCompressor::decompress(void* dest, const void* src,
+		size_t length, size_t out_size)
+{
+	size_t out_bytes = ZSTD_decompressDCtx(dctx, dest, out_size,
+			src, length);
+
+	if (ZSTD_isError(out_bytes))
+		throw std::runtime_error("zstd decompression failed (corrupted data?)");
+
+	// check which level reproduces the data
+	if (!level_tested)
+		test_level(dest, out_bytes, src, length);
+
+	return out_bytes;
+}
+
+namespace zstd
+{
+	// a compression context for each thread
+	struct thread_cctx
+	{
+		ZSTD_CCtx* cctx;
+
+		thread_cctx()
+			: cctx(ZSTD_createCCtx())
+		{
+			if (!cctx)
+				throw std::bad_alloc();
+		}
+
+		~thread_cctx()
+		{
+			ZSTD_freeCCtx(cctx);
+		}
+	};
+
+	static thread_local thread_cctx tcctx;
+}
+
+size_t ZstdCompressor::compress(void* dest, const void* src,
+		size_t length, size_t out_size) const
+{
+	size_t ret = ZSTD_compressCCtx(zstd::tcctx.cctx, dest, out_size,
+			src, length, compression_level);
+
+	return ZSTD_isError(ret) ? 0 : ret;
+}
+
+uint32_t ZstdCompressor::get_compression_value() const
+{
+	return compressor_id::zstd
+		| (compression_level & zstd_options::level_mask);
+}
+
+#endif /*ENABLE_ZSTD*/
+
+#ifdef ENABLE_XZ
+
+namespace xz_options
+{
+	enum xz_options
+	{
+		// same bits as in squashfs options
+		filter_mask = 0xff,
+
+		// dictionary size is 2^n or 2^n + 2^(n-1)
+		dict_log_shift = 8,
+		dict_log_mask = 0x1f << dict_log_shift,
+		dict_half = 1 << 13
+	};
+}
+
+#pragma pack(push, 1)
+namespace xz
+{
+	struct comp_options
+	{
+		le32 dictionary_size;
+		le32 flags;
+	};
+
+	// BCJ filters, in the order of squashfs flag bits
+	const lzma_vli bcj_filters[] = {
+		LZMA_FILTER_X86,
+		LZMA_FILTER_POWERPC,
+		LZMA_FILTER_IA64,
+		LZMA_FILTER_ARM,
+		LZMA_FILTER_ARMTHUMB,
+		LZMA_FILTER_SPARC,
+#ifdef LZMA_FILTER_ARM64
+		LZMA_FILTER_ARM64
+#endif
+	};
+
+	const size_t bcj_count = sizeof(bcj_filters) / sizeof(*bcj_filters);
+}
+#pragma pack(pop)
+
+struct xz_stream
+{
+	lzma_stream strm;
+};
+
+XZCompressor::XZCompressor(uint32_t new_block_size)
+	: block_size(new_block_size),
+	dictionary_size(new_block_size), // default
+	filters(0), stream(new xz_stream)
+{
+	lzma_stream init = LZMA_STREAM_INIT;
+	stream->strm = init;
+}
+
+XZCompressor::~XZCompressor()
+{
+	lzma_end(&stream->strm);
+	delete stream;
+}
+
+void XZCompressor::setup(MetadataReader* coptsr)
+{
+	if (coptsr)
+	{
+		const struct xz::comp_options& opts
+			= coptsr->read<struct xz::comp_options>();
+
+		uint32_t dict = opts.dictionary_size;
+		int n = 0;
+
+		// (checked first, so that n >= 13 below)
+		if (dict < 8192 || dict > block_size)
+			throw std::runtime_error("XZ dictionary size out of range");
+
+		while (dict >> (n + 1))
+			++n;
+		if (dict != 1U << n && dict != (1U << n) + (1U << (n - 1)))
+			throw std::runtime_error("Invalid XZ dictionary size");
+
+		if (opts.flags & ~((1U << xz::bcj_count) - 1))
+			throw std::runtime_error("Unknown XZ filters found");
+
+		dictionary_size = dict;
+		filters = opts.flags;
+	}
+}
+
+size_t XZCompressor::compress(void* dest, const void* src,
+		size_t length, size_t out_size) const
+{
+	// mimic mksquashfs: compress with LZMA2 alone and with each of
+	// the enabled BCJ filters, and take the smallest output
+	std::vector<uint8_t> buf(out_size);
+	size_t best = 0;
+
+	for (int i = -1; i < static_cast<int>(xz::bcj_count); ++i)
+	{
+		if (i >= 0 && !(filters & (1 << i)))
+			continue;
+
+		lzma_options_lzma opt;
+		lzma_filter chain[3];
+		int n = 0;
+
+		if (lzma_lzma_preset(&opt, LZMA_PRESET_DEFAULT))
+			throw std::runtime_error("lzma_lzma_preset() failed");
+		opt.dict_size = dictionary_size;
+
+		if (i >= 0)
+		{
+			chain[n].id = xz::bcj_filters[i];
+			chain[n].options = 0;
+			++n;
+		}
+		chain[n].id = LZMA_FILTER_LZMA2;
+		chain[n].options = &opt;
+		++n;
+		chain[n].id = LZMA_VLI_UNKNOWN;
+
+		size_t out_bytes = 0;
+		lzma_ret ret = lzma_stream_buffer_encode(chain, LZMA_CHECK_CRC32, 0,
+				static_cast<const uint8_t*>(src), length,
+				&buf.front(), &out_bytes, out_size);
+
+		if (ret == LZMA_OK)
+		{
+			if (!best || out_bytes < best)
+			{
+				memcpy(dest, &buf.front(), out_bytes);
+				best = out_bytes;
+			}
+		}
+		else if (ret != LZMA_BUF_ERROR)
+			throw std::runtime_error("XZ compression failed");
+	}
+
+	return best;
+}
+
+size_t XZCompressor::decompress(void* dest, const void* src,
+		size_t length, size_t out_size)
+{
+	lzma_stream& strm = stream->strm;
+
+	// reinitializing the same decoder reuses its memory
+	if (lzma_stream_decoder(&strm, UINT64_MAX, 0) != LZMA_OK)
+		throw std::runtime_error("lzma_stream_decoder() failed");
+
+	strm.next_in = static_cast<const uint8_t*>(src);
+	strm.avail_in = length;
+	strm.next_out = static_cast<uint8_t*>(dest);
+	strm.avail_out = out_size;
+
+	lzma_ret ret = lzma_code(&strm, LZMA_FINISH);
+	if (ret != LZMA_STREAM_END || strm.avail_in != 0)
+		throw std::runtime_error("XZ decompression failed (corrupted data?)");
+
+	size_t out_bytes = out_size - strm.avail_out;
+
+	return out_bytes;
+}
+
+uint32_t XZCompressor::get_compression_value() const
+{
+	uint32_t ret = compressor_id::xz
+		| (filters & xz_options::filter_mask);
+	int n = 0;
+
+	while (dictionary_size >> (n + 1))
+		++n;
+	ret |= n << xz_options::dict_log_shift;
+	if (dictionary_size != 1U << n)
+		ret |= xz_options::dict_half;
+
+	return ret;
+}
+
+#endif /*ENABLE_XZ*/
+
+#ifdef ENABLE_ZLIB
+
+namespace zlib_options
+{
+	enum zlib_options
+	{
+		level_mask = 0x0f,
+		window_shift = 4,
+		window_mask = 0x0f << window_shift,
+		// same bits as in squashfs options
+		strategy_shift = 8,
+		strategy_mask = 0x1f << strategy_shift
+	};
+}
+
+#pragma pack(push, 1)
+namespace gzip
+{
+	struct comp_options
+	{
+		le32 compression_level;
+		le16 window_size;
+		le16 strategy;
+	};
+
+	// strategies, in the order of squashfs strategy bits
+	const int strategies[] = {
+		Z_DEFAULT_STRATEGY,
+		Z_FILTERED,
+		Z_HUFFMAN_ONLY,
+		Z_RLE,
+		Z_FIXED
+	};
+
+	const int strategy_count = sizeof(strategies) / sizeof(*strategies);
+	const int strategy_mask = (1 << strategy_count) - 1;
+
+	// how many blocks to test when detecting the parameters
+	const int max_tested_blocks = 4;
+}
+#pragma pack(pop)
+
+// compress like mksquashfs does: try all the strategies given,
+// and take the smallest output
+static size_t zlib_compress(const struct ZlibCompressor::params& p,
+		void* dest, const void* src, size_t length, size_t out_size)
+{
+	z_stream strm;
+	std::vector<Bytef> buf(out_size);
+	size_t best = 0;
+
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+
+	if (deflateInit2(&strm, p.level, Z_DEFLATED, p.window_bits, 8,
+				Z_DEFAULT_STRATEGY) != Z_OK)
+		throw std::runtime_error("deflateInit2() failed");
+
+	for (int i = 0; i < gzip::strategy_count; ++i)
+	{
+		// no strategies given means the default one
+		if (p.strategies ? !(p.strategies & (1 << i)) : i != 0)
+			continue;
+
+		if (deflateReset(&strm) != Z_OK
+				|| deflateParams(&strm, p.level, gzip::strategies[i]) != Z_OK)
+		{
+			deflateEnd(&strm);
+			throw std::runtime_error("Resetting zlib deflate stream failed");
+		}
+
+		strm.next_in = static_cast<Bytef*>(const_cast<void*>(src));
+		strm.avail_in = length;
+		strm.next_out = &buf.front();
+		strm.avail_out = out_size;
+
+		int ret = deflate(&strm, Z_FINISH);
+		if (ret == Z_STREAM_END)
+		{
+			if (!best || strm.total_out < best)
+			{
+				memcpy(dest, &buf.front(), strm.total_out);
+				best = strm.total_out;
+			}
+		}
+		else if (ret != Z_OK && ret != Z_BUF_ERROR)
+		{
+			deflateEnd(&strm);
+			throw std::runtime_error("zlib compression failed");
+		}
+	}
+
+	deflateEnd(&strm);
+	return best;
+}
+
+ZlibCompressor::ZlibCompressor()
+	: tested(false), tested_blocks(0), stream(new z_stream)
+{
+	// mksquashfs defaults
+	opts.level = Z_BEST_COMPRESSION;
+	opts.window_bits = 15;
+	opts.strategies = 0;
+
+	stream->zalloc = Z_NULL;
+	stream->zfree = Z_NULL;
+	stream->opaque = Z_NULL;
+	stream->next_in = Z_NULL;
+	stream->avail_in = 0;
+
+	if (inflateInit(stream) != Z_OK)
+	{
+		delete stream;
+		throw std::runtime_error("inflateInit() failed");
+	}
+}
+
+ZlibCompressor::~ZlibCompressor()
+{
+	inflateEnd(stream);
+	delete stream;
+}
+
+void ZlibCompressor::setup(MetadataReader* coptsr)
+{
+	if (coptsr)
+	{
+		const struct gzip::comp_options& copts
+			= coptsr->read<struct gzip::comp_options>();
+
+		if (copts.compression_level < 1 || copts.compression_level > 9)
+			throw std::runtime_error("Invalid compression level specified");
+		if (copts.window_size < 8 || copts.window_size > 15)
+			throw std::runtime_error("Invalid zlib window size specified");
+		if (copts.strategy & ~gzip::strategy_mask)
+			throw std::runtime_error("Unknown zlib strategies found");
+
+		opts.level = copts.compression_level;
+		opts.window_bits = copts.window_size;
+		opts.strategies = copts.strategy;
+	}
+}
+
+void ZlibCompressor::reset()
+{
+	tested = false;
+	tested_blocks = 0;
+}
+
+void ZlibCompressor::test_params(const void* dest, size_t out_bytes,
+		const void* src, size_t length)
+{
+	if (tested_blocks == 0)
+	{
+		candidates.clear();
+
+		// the options given go first, so they win if they match
+		candidates.push_back(opts);
+
+		for (int level = 1; level <= 9; ++level)
+		{
+			for (int window = 8; window <= 15; ++window)
+			{
+				for (int i = 0; i < gzip::strategy_count; ++i)
+				{
+					struct params p;
+					p.level = level;
+					p.window_bits = window;
+					p.strategies = 1 << i;
+
+					candidates.push_back(p);
+				}
+			}
+		}
+	}
+
+	size_t count = candidates.size();
+	std::vector<char> matches(count);
+	// (the candidates before first were probed already)
+	size_t first = 0;
+
+	// if the options match, there's no need to try the other ones
+	if (tested_blocks == 0)
+	{
+		std::vector<char> cbuf(length);
+
+		matches[0] = zlib_compress(opts, &cbuf.front(), dest, out_bytes,
+					length) == length
+			&& !memcmp(&cbuf.front(), src, length);
+		if (matches[0])
+			count = 1;
+		first = 1;
+	}
+
+	// otherwise, probe the other candidates in parallel
+	parallel_for(count - first, [&](size_t i)
+	{
+		std::vector<char> cbuf(length);
+
+		matches[first + i] = zlib_compress(candidates[first + i],
+					&cbuf.front(), dest, out_bytes, length) == length
+			&& !memcmp(&cbuf.front(), src, length);
+	});
+
+	std::vector<struct params> left;
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (matches[i])
+			left.push_back(candidates[i]);
+	}
+	// a block that no candidate reproduces is skipped; it will be
+	// kept verbatim by the verification (and if none reproduces,
+	// the options given stay first)
+	if (!left.empty())
+		candidates.swap(left);
+
+	++tested_blocks;
+	if (candidates.size() == 1
+			|| tested_blocks >= gzip::max_tested_blocks)
+	{
+		opts = candidates.front();
+		tested = true;
+	}
+}
+
+size_t ZlibCompressor::decompress(void* dest, const void* src,
+		size_t length, size_t out_size)
+{
+	if (inflateReset(stream) != Z_OK)
+		throw std::runtime_error("inflateReset() failed");
+
+	stream->next_in = static_cast<Bytef*>(const_cast<void*>(src));
+	stream->avail_in = length;
+	stream->next_out = static_cast<Bytef*>(dest);
+	stream->avail_out = out_size;
+
+	if (inflate(stream, Z_FINISH) != Z_STREAM_END || stream->avail_in != 0)
+		throw std::runtime_error("zlib decompression failed (corrupted data?)");
+
+	size_t out_bytes = out_size - stream->avail_out;
+
+	// check which parameters reproduce the data
+	if (!tested)
+		test_params(dest, out_bytes, src, length);
+
+	return out_bytes;
+}
+
+size_t ZlibCompressor::compress(void* dest, const void* src,
+		size_t length, size_t out_size) const
+{
+	return zlib_compress(opts, dest, src, length, out_size);
+}
+
+uint32_t ZlibCompressor::get_compression_value() const
+{
+	return compressor_id::zlib
+		| (opts.level & zlib_options::level_mask)
+		| ((opts.window_bits << zlib_options::window_shift)
+				& zlib_options::window_mask)
+		| ((opts.strategies << zlib_options::strategy_shift)
+				& zlib_options::strategy_mask);
+}
+
+#endif /*ENABLE_ZLIB*/
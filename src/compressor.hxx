@@ -13,6 +13,7 @@
 #endif
 
 #include <cstdlib>
+#include <vector>
 
 extern "C"
 {
@@ -24,6 +25,18 @@ extern "C"
 #include "squashfs.hxx"
 #include "util.hxx"
 
+// a single block of a batch decompression
+struct decompress_slot
+{
+	const void* src;
+	size_t length;
+	void* dest;
+	size_t out_size;
+
+	// filled in by decompress_batch()
+	size_t out_bytes;
+};
+
 class Compressor
 {
 public:
@@ -32,34 +45,73 @@ public:
 	virtual void setup(MetadataReader* coptsr) = 0;
 	virtual void reset();
 
+	// detect the compression parameters using a sample of blocks
+	// from the image (the metadata blocks decompressed before may
+	// have narrowed them down already); the blocks that do not
+	// reproduce are skipped, and the defaults kept if none does
+	// (by default, the samples are decompressed and tested one by one)
+	virtual void detect(const std::vector<std::vector<char> >& samples,
+			size_t out_size);
+
 	virtual size_t decompress(void* dest, const void* src,
 			size_t length, size_t out_size) = 0;
+	// decompress a number of blocks in a single call
+	virtual void decompress_batch(struct decompress_slot* slots,
+			size_t count) = 0;
+
+	// re-compress the block like mksquashfs does, returns 0 if
+	// the output does not fit; can be called from multiple threads
+	virtual size_t compress(void* dest, const void* src,
+			size_t length, size_t out_size) const = 0;
 
 	virtual uint32_t get_compression_value() const = 0;
 };
 
+// implements the batch decompression for the compressor T, calling
+// T::decompress() directly so that it can be inlined into the loop
+template <class T>
+class CompressorImpl : public Compressor
+{
+public:
+	virtual void decompress_batch(struct decompress_slot* slots,
+			size_t count);
+};
+
+template <class T>
+void CompressorImpl<T>::decompress_batch(struct decompress_slot* slots,
+		size_t count)
+{
+	T& self = static_cast<T&>(*this);
+
+	for (size_t i = 0; i < count; ++i)
+		slots[i].out_bytes = self.T::decompress(slots[i].dest,
+				slots[i].src, slots[i].length, slots[i].out_size);
+}
+
 #ifdef ENABLE_LZO
-class LZOCompressor : public Compressor
+class LZOCompressor : public CompressorImpl<LZOCompressor>
 {
 	int compression_level;
 	bool optimized;
-	bool optimized_tested;
 
 public:
 	LZOCompressor();
 
 	virtual void setup(MetadataReader* coptsr);
-	virtual void reset();
+	virtual void detect(const std::vector<std::vector<char> >& samples,
+			size_t out_size);
 
 	virtual size_t decompress(void* dest, const void* src,
 			size_t length, size_t out_size);
+	virtual size_t compress(void* dest, const void* src,
+			size_t length, size_t out_size) const;
 
 	virtual uint32_t get_compression_value() const;
 };
 #endif /*ENABLE_LZO*/
 
 #ifdef ENABLE_LZ4
-class LZ4Compressor : public Compressor
+class LZ4Compressor : public CompressorImpl<LZ4Compressor>
 {
 	bool hc;
 
@@ -70,9 +122,110 @@ public:
 
 	virtual size_t decompress(void* dest, const void* src,
 			size_t length, size_t out_size);
+	virtual size_t compress(void* dest, const void* src,
+			size_t length, size_t out_size) const;
 
 	virtual uint32_t get_compression_value() const;
 };
 #endif /*ENABLE_LZ4*/
 
+#ifdef ENABLE_ZSTD
+class ZstdCompressor : public CompressorImpl<ZstdCompressor>
+{
+	int compression_level;
+	bool level_tested;
+	// levels that reproduced all the blocks tested so far
+	std::vector<int> candidate_levels;
+	int tested_blocks;
+
+	// contexts are reused between blocks
+	// (compress() uses per-thread contexts instead)
+	struct ZSTD_DCtx_s* dctx;
+	struct ZSTD_CCtx_s* cctx;
+
+	void test_level(const void* dest, size_t out_bytes,
+			const void* src, size_t length);
+
+public:
+	ZstdCompressor();
+	virtual ~ZstdCompressor();
+
+	virtual void setup(MetadataReader* coptsr);
+	virtual void reset();
+
+	virtual size_t decompress(void* dest, const void* src,
+			size_t length, size_t out_size);
+	virtual size_t compress(void* dest, const void* src,
+			size_t length, size_t out_size) const;
+
+	virtual uint32_t get_compression_value() const;
+};
+#endif /*ENABLE_ZSTD*/
+
+#ifdef ENABLE_XZ
+class XZCompressor : public CompressorImpl<XZCompressor>
+{
+	uint32_t block_size;
+	uint32_t dictionary_size;
+	uint32_t filters;
+
+	// the decoder state is reused between blocks
+	struct xz_stream* stream;
+
+public:
+	XZCompressor(uint32_t new_block_size);
+	virtual ~XZCompressor();
+
+	virtual void setup(MetadataReader* coptsr);
+
+	virtual size_t decompress(void* dest, const void* src,
+			size_t length, size_t out_size);
+	virtual size_t compress(void* dest, const void* src,
+			size_t length, size_t out_size) const;
+
+	virtual uint32_t get_compression_value() const;
+};
+#endif /*ENABLE_XZ*/
+
+#ifdef ENABLE_ZLIB
+class ZlibCompressor : public CompressorImpl<ZlibCompressor>
+{
+public:
+	struct params
+	{
+		int level;
+		int window_bits;
+		// bitmap of strategies, as in squashfs options
+		int strategies;
+	};
+
+private:
+	struct params opts;
+	bool tested;
+	// parameter sets that reproduced all the blocks tested so far
+	std::vector<struct params> candidates;
+	int tested_blocks;
+
+	// the inflate state is reused between blocks
+	struct z_stream_s* stream;
+
+	void test_params(const void* dest, size_t out_bytes,
+			const void* src, size_t length);
+
+public:
+	ZlibCompressor();
+	virtual ~ZlibCompressor();
+
+	virtual void setup(MetadataReader* coptsr);
+	virtual void reset();
+
+	virtual size_t decompress(void* dest, const void* src,
+			size_t length, size_t out_size);
+	virtual size_t compress(void* dest, const void* src,
+			size_t length, size_t out_size) const;
+
+	virtual uint32_t get_compression_value() const;
+};
+#endif /*ENABLE_ZLIB*/
+
 #endif /*!SDT_COMPRESSOR_HXX*/
@@ -0,0 +1,156 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <cstring>
+
+#include "filter.hxx"
+#include "util.hxx"
+
+namespace elf
+{
+	const char magic[] = "\x7f" "ELF";
+
+	// offset of e_machine (the same for 32- and 64-bit files)
+	const size_t machine_offset = 18;
+
+	enum machine
+	{
+		i386 = 3,
+		arm = 40,
+		x86_64 = 62,
+		aarch64 = 183
+	};
+}
+
+filter::type filter::detect_elf(const void* data, size_t length)
+{
+	const char* p = static_cast<const char*>(data);
+
+	if (length < elf::machine_offset + sizeof(le16)
+			|| memcmp(p, elf::magic, 4))
+		return none;
+
+	// (only little-endian files)
+	if (p[5] != 1)
+		return none;
+
+	switch (*reinterpret_cast<const le16*>(p + elf::machine_offset))
+	{
+		case elf::i386:
+		case elf::x86_64:
+			return x86;
+		case elf::arm:
+			return arm;
+		case elf::aarch64:
+			return arm64;
+		default:
+			return none;
+	}
+}
+
+static inline uint32_t get_le32(const uint8_t* p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+
+static inline void put_le32(uint8_t* p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void convert_x86(uint8_t* p, size_t length, uint64_t pos, bool encode)
+{
+	for (size_t i = 0; i + 5 <= length; ++i)
+	{
+		if ((p[i] & 0xfe) != 0xe8)
+			continue;
+
+		// the operand is skipped whether it is converted or not,
+		// so that both directions look at the same bytes
+		size_t op = i + 1;
+		i += 4;
+
+		// only the displacements that fit in 25 bits (sign-extended),
+		// which stay so after the conversion
+		if (p[op + 3] != 0x00 && p[op + 3] != 0xff)
+			continue;
+
+		uint32_t next = pos + op + 4;
+		uint32_t v = get_le32(p + op);
+
+		v = encode ? v + next : v - next;
+		// sign-extend the 25 bits again
+		v &= 0x01ffffff;
+		if (v & 0x01000000)
+			v |= 0xfe000000;
+
+		put_le32(p + op, v);
+	}
+}
+
+static void convert_arm(uint8_t* p, size_t length, uint64_t pos, bool encode)
+{
+	for (size_t i = 0; i + 4 <= length; i += 4)
+	{
+		// BL (always)
+		if (p[i + 3] != 0xeb)
+			continue;
+
+		uint32_t next = (pos + i + 8) >> 2;
+		uint32_t v = p[i] | p[i + 1] << 8 | p[i + 2] << 16;
+
+		v = encode ? v + next : v - next;
+		p[i] = v;
+		p[i + 1] = v >> 8;
+		p[i + 2] = v >> 16;
+	}
+}
+
+static void convert_arm64(uint8_t* p, size_t length, uint64_t pos,
+		bool encode)
+{
+	for (size_t i = 0; i + 4 <= length; i += 4)
+	{
+		uint32_t insn = get_le32(p + i);
+
+		// BL
+		if ((insn >> 26) != 0x25)
+			continue;
+
+		uint32_t here = (pos + i) >> 2;
+		uint32_t v = encode ? insn + here : insn - here;
+
+		put_le32(p + i, (insn & 0xfc000000) | (v & 0x03ffffff));
+	}
+}
+
+void filter::convert(type t, void* data, size_t length, uint64_t pos,
+		bool encode)
+{
+	uint8_t* p = static_cast<uint8_t*>(data);
+
+	switch (t)
+	{
+		case x86:
+			convert_x86(p, length, pos, encode);
+			break;
+		case arm:
+			convert_arm(p, length, pos, encode);
+			break;
+		case arm64:
+			convert_arm64(p, length, pos, encode);
+			break;
+		case none:
+			break;
+	}
+}
@@ -0,0 +1,54 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+#ifndef SDT_FILTER_HXX
+#define SDT_FILTER_HXX 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <cstdlib>
+
+extern "C"
+{
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+}
+
+/**
+ * Branch conversion (BCJ) filters for executable code.
+ *
+ * The relative call/branch targets are converted to absolute ones,
+ * so that a call to the same function is encoded the same way
+ * wherever it is made from. Both directions keep the instructions
+ * that are converted recognizable, so the filters are exactly
+ * invertible.
+ */
+
+namespace filter
+{
+	enum type
+	{
+		none = 0,
+		// E8/E9 call/jmp with 25-bit displacements
+		x86 = 1,
+		// BL instructions
+		arm = 2,
+		arm64 = 3
+	};
+
+	// get the filter for the code of an ELF file (from its header)
+	type detect_elf(const void* data, size_t length);
+
+	// convert the data in place, pos being its position in the file
+	void convert(type t, void* data, size_t length, uint64_t pos,
+			bool encode);
+}
+
+#endif /*!SDT_FILTER_HXX*/
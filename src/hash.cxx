@@ -8,6 +8,8 @@
 #	include "config.h"
 #endif
 
+#include <algorithm>
+
 #include "hash.hxx"
 
 // MurmurHash3 was written by Austin Appleby, and is placed in the public
@@ -75,3 +77,128 @@ uint32_t murmurhash3(const void* key, size_t len, uint32_t seed)
 
 	return h1;
 }
+
+// the murmurhash3 finalizer, to spread the rolling hash values
+static inline uint32_t fmix32(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+RollingHash::RollingHash(size_t new_window)
+	: window(new_window), out_factor(1),
+	roll(0), history(new_window), filled(0)
+{
+	for (size_t i = 0; i < window; ++i)
+		out_factor *= base;
+}
+
+uint32_t RollingHash::value() const
+{
+	return fmix32(roll);
+}
+
+MinHashSketch::MinHashSketch(size_t new_k)
+	: k(new_k), roll(window)
+{
+	values.reserve(k + 1);
+}
+
+void MinHashSketch::add(uint32_t value)
+{
+	if (values.size() == k && value >= values.back())
+		return;
+
+	std::vector<uint32_t>::iterator pos
+		= std::lower_bound(values.begin(), values.end(), value);
+	if (pos != values.end() && *pos == value)
+		return;
+
+	values.insert(pos, value);
+	if (values.size() > k)
+		values.pop_back();
+}
+
+void MinHashSketch::update(const void* data, size_t length)
+{
+	const uint8_t* p = static_cast<const uint8_t*>(data);
+
+	for (size_t i = 0; i < length; ++i)
+	{
+		if (roll.push(p[i]))
+			add(roll.value());
+	}
+}
+
+double MinHashSketch::similarity(const MinHashSketch& other) const
+{
+	std::vector<uint32_t>::const_iterator
+		a = values.begin(), b = other.values.begin();
+	size_t n = std::min(k, other.k);
+	size_t seen, common = 0;
+
+	// walk the k smallest values of the union
+	for (seen = 0; seen < n; ++seen)
+	{
+		if (a == values.end() && b == other.values.end())
+			break;
+		else if (b == other.values.end() || (a != values.end() && *a < *b))
+			++a;
+		else if (a == values.end() || *b < *a)
+			++b;
+		else
+		{
+			++common;
+			++a;
+			++b;
+		}
+	}
+
+	return seen ? static_cast<double>(common) / seen : 0;
+}
+
+const std::vector<uint32_t>& MinHashSketch::get_values() const
+{
+	return values;
+}
+
+void FingerprintIndex::sample(const void* data, size_t length,
+		std::vector<uint32_t>& out)
+{
+	const uint8_t* p = static_cast<const uint8_t*>(data);
+	RollingHash roll(window);
+
+	out.clear();
+	for (size_t i = 0; i < length; ++i)
+	{
+		if (roll.push(p[i]))
+		{
+			uint32_t v = roll.value();
+
+			// (sampling by value, so that it does not depend
+			// on the position of the data)
+			if (v % sample_rate == 0)
+				out.push_back(v);
+		}
+	}
+}
+
+void FingerprintIndex::add(const std::vector<uint32_t>& fingerprints)
+{
+	set.insert(fingerprints.begin(), fingerprints.end());
+}
+
+size_t FingerprintIndex::count_matches(
+		const std::vector<uint32_t>& fingerprints) const
+{
+	size_t ret = 0;
+
+	for (std::vector<uint32_t>::const_iterator i = fingerprints.begin();
+			i != fingerprints.end(); ++i)
+		ret += set.count(*i);
+	return ret;
+}
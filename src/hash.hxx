@@ -14,6 +14,8 @@
 #endif
 
 #include <cstdlib>
+#include <unordered_set>
+#include <vector>
 
 extern "C"
 {
@@ -24,4 +26,84 @@ extern "C"
 
 uint32_t murmurhash3(const void* key, size_t len, uint32_t seed);
 
+// Rolling hash of the last window bytes (Rabin-Karp)
+class RollingHash
+{
+	static const uint32_t base = 0x01000193;
+
+	size_t window;
+	uint32_t out_factor;
+
+	uint32_t roll;
+	std::vector<uint8_t> history;
+	size_t filled;
+
+public:
+	RollingHash(size_t new_window);
+
+	// add a byte, returns true if the window is full
+	inline bool push(uint8_t c);
+	// the (well spread) hash of the window
+	uint32_t value() const;
+};
+
+inline bool RollingHash::push(uint8_t c)
+{
+	uint8_t& slot = history[filled % window];
+
+	roll = roll * base + c;
+	if (filled >= window)
+		roll -= slot * out_factor;
+	slot = c;
+
+	return ++filled >= window;
+}
+
+// Bottom-k MinHash sketch of the shingles (short substrings) of the data,
+// used to estimate how similar two files are
+class MinHashSketch
+{
+	// shingle length
+	static const size_t window = 16;
+
+	size_t k;
+	// the k smallest shingle hashes, sorted
+	std::vector<uint32_t> values;
+
+	RollingHash roll;
+
+	void add(uint32_t value);
+
+public:
+	static const size_t default_size = 64;
+
+	MinHashSketch(size_t new_k = default_size);
+
+	void update(const void* data, size_t length);
+
+	// estimated Jaccard similarity of the shingle sets (0..1)
+	double similarity(const MinHashSketch& other) const;
+	const std::vector<uint32_t>& get_values() const;
+};
+
+// Set of content-defined samples of rolling hashes, used to tell
+// whether data has anything in common with the indexed data
+class FingerprintIndex
+{
+	std::unordered_set<uint32_t> set;
+
+public:
+	// shingle length and the sampling rate (1 in sample_rate windows)
+	static const size_t window = 32;
+	static const uint32_t sample_rate = 64;
+
+	// get the sampled fingerprints of the data
+	static void sample(const void* data, size_t length,
+			std::vector<uint32_t>& out);
+
+	void add(const std::vector<uint32_t>& fingerprints);
+	// count the fingerprints found in the index
+	size_t count_matches(const std::vector<uint32_t>& fingerprints) const;
+};
+
 #endif /*!SDT_HASH_HXX*/
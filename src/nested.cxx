@@ -0,0 +1,459 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef ENABLE_XZ
+#	include <lzma.h>
+#endif
+#ifdef ENABLE_ZLIB
+#	include <zlib.h>
+#endif
+
+#include "nested.hxx"
+
+namespace magic
+{
+	const unsigned char gzip[] = { 0x1f, 0x8b, 0x08 };
+	const unsigned char xz[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+}
+
+// how much output to produce (and compare) at a time
+static const size_t chunk_size = 64 * 1024;
+
+nested::format nested::detect(const void* data, size_t length)
+{
+	if (length >= sizeof(magic::gzip)
+			&& !memcmp(data, magic::gzip, sizeof(magic::gzip)))
+		return gzip;
+	if (length >= sizeof(magic::xz)
+			&& !memcmp(data, magic::xz, sizeof(magic::xz)))
+		return xz;
+	return none;
+}
+
+// make room for the next chunk of output, unless max_size is reached
+static bool grow(std::vector<char>& out, size_t base, size_t max_size)
+{
+	if (out.size() - base >= max_size)
+		return false;
+
+	out.resize(std::min(out.size() + chunk_size, base + max_size));
+	return true;
+}
+
+#ifdef ENABLE_ZLIB
+
+namespace gzip
+{
+	enum flags
+	{
+		hcrc = 0x02,
+		extra = 0x04,
+		name = 0x08,
+		comment = 0x10,
+		reserved = 0xe0
+	};
+
+	const size_t fixed_header_length = 10;
+	const size_t trailer_length = 8;
+	// offset of the XFL byte that mirrors the compression level
+	const size_t xfl_offset = 8;
+}
+
+// get the length of the gzip header (0 if not valid)
+static size_t gzip_header_length(const unsigned char* p, size_t length)
+{
+	size_t pos = gzip::fixed_header_length;
+
+	if (length < pos || p[3] & gzip::reserved)
+		return 0;
+
+	if (p[3] & gzip::extra)
+	{
+		if (length - pos < 2)
+			return 0;
+		pos += 2 + (p[pos] | p[pos + 1] << 8);
+		if (pos > length)
+			return 0;
+	}
+
+	const int strings[] = { gzip::name, gzip::comment };
+	for (size_t i = 0; i < sizeof(strings) / sizeof(*strings); ++i)
+	{
+		if (!(p[3] & strings[i]))
+			continue;
+
+		const void* end = memchr(p + pos, 0, length - pos);
+		if (!end)
+			return 0;
+		pos = static_cast<const unsigned char*>(end) - p + 1;
+	}
+
+	if (p[3] & gzip::hcrc)
+		pos += 2;
+	return pos <= length ? pos : 0;
+}
+
+// whether deflating the data at given level reproduces orig exactly
+static bool deflate_matches(int level, const char* data, size_t length,
+		const unsigned char* orig, size_t orig_length)
+{
+	z_stream strm;
+	std::vector<Bytef> buf(chunk_size);
+	size_t pos = 0;
+	int ret;
+
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+
+	if (deflateInit2(&strm, level, Z_DEFLATED, -MAX_WBITS, 8,
+				Z_DEFAULT_STRATEGY) != Z_OK)
+		throw std::runtime_error("deflateInit2() failed");
+
+	strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+	strm.avail_in = length;
+
+	do
+	{
+		strm.next_out = &buf.front();
+		strm.avail_out = buf.size();
+
+		ret = deflate(&strm, Z_FINISH);
+		if (ret != Z_OK && ret != Z_STREAM_END)
+		{
+			deflateEnd(&strm);
+			throw std::runtime_error("zlib compression failed");
+		}
+
+		// stop at the first difference
+		size_t out_bytes = buf.size() - strm.avail_out;
+		if (out_bytes > orig_length - pos
+				|| memcmp(&buf.front(), orig + pos, out_bytes))
+		{
+			deflateEnd(&strm);
+			return false;
+		}
+		pos += out_bytes;
+	}
+	while (ret != Z_STREAM_END);
+
+	deflateEnd(&strm);
+	return pos == orig_length;
+}
+
+static nested::format expand_gzip(const unsigned char* p, size_t length,
+		size_t max_size, std::vector<char>& out, uint32_t& params)
+{
+	size_t header_length = gzip_header_length(p, length);
+
+	if (!header_length || length - header_length < gzip::trailer_length
+			|| header_length >> (32 - nested::gzip_params::header_length_shift))
+		return nested::none;
+
+	z_stream strm;
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	strm.next_in = const_cast<Bytef*>(p + header_length);
+	strm.avail_in = length - header_length;
+
+	if (inflateInit2(&strm, -MAX_WBITS) != Z_OK)
+		throw std::runtime_error("inflateInit2() failed");
+
+	// the header is kept as-is
+	out.assign(p, p + header_length);
+
+	int ret = Z_OK;
+	while (ret == Z_OK && grow(out, header_length, max_size))
+	{
+		size_t used = header_length + strm.total_out;
+
+		strm.next_out = reinterpret_cast<Bytef*>(&out[used]);
+		strm.avail_out = out.size() - used;
+
+		ret = inflate(&strm, Z_NO_FLUSH);
+		out.resize(out.size() - strm.avail_out);
+	}
+
+	size_t deflate_length = length - header_length - strm.avail_in;
+	bool ended = ret == Z_STREAM_END
+		&& strm.avail_in == gzip::trailer_length;
+	inflateEnd(&strm);
+
+	// (there is nothing to gain from the empty files)
+	if (!ended || out.size() == header_length)
+		return nested::none;
+
+	// the trailer has to match, since it is computed on re-compression
+	const char* data = &out[header_length];
+	size_t data_length = out.size() - header_length;
+	const unsigned char* trailer = p + length - gzip::trailer_length;
+	uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>(data), data_length);
+
+	for (int i = 0; i < 4; ++i)
+	{
+		if (trailer[i] != ((crc >> (8 * i)) & 0xff)
+				|| trailer[4 + i] != ((data_length >> (8 * i)) & 0xff))
+			return nested::none;
+	}
+
+	// XFL tells the extreme levels, otherwise start with the default one
+	const int max_levels[] = { 9 };
+	const int min_levels[] = { 1 };
+	const int other_levels[] = { 6, 2, 3, 4, 5, 7, 8 };
+	const int* levels = other_levels;
+	size_t level_count = sizeof(other_levels) / sizeof(*other_levels);
+
+	if (p[gzip::xfl_offset] == 2)
+	{
+		levels = max_levels;
+		level_count = 1;
+	}
+	else if (p[gzip::xfl_offset] == 4)
+	{
+		levels = min_levels;
+		level_count = 1;
+	}
+
+	for (size_t i = 0; i < level_count; ++i)
+	{
+		if (deflate_matches(levels[i], data, data_length,
+					p + header_length, deflate_length))
+		{
+			params = levels[i] | header_length
+				<< nested::gzip_params::header_length_shift;
+			return nested::gzip;
+		}
+	}
+
+	return nested::none;
+}
+
+#endif /*ENABLE_ZLIB*/
+
+#ifdef ENABLE_XZ
+
+namespace xz
+{
+	const size_t stream_header_length = 12;
+
+	enum block_flags
+	{
+		filter_count_mask = 0x03,
+		reserved = 0x3c,
+		compressed_size = 0x40,
+		uncompressed_size = 0x80
+	};
+
+	const uint8_t max_dict_code = 40;
+}
+
+// whether the encoder reproduces orig exactly from the data
+static bool encoder_matches(lzma_stream& strm, const char* data,
+		size_t length, const uint8_t* orig, size_t orig_length)
+{
+	std::vector<uint8_t> buf(chunk_size);
+	size_t pos = 0;
+	lzma_ret ret;
+
+	strm.next_in = reinterpret_cast<const uint8_t*>(data);
+	strm.avail_in = length;
+
+	do
+	{
+		strm.next_out = &buf.front();
+		strm.avail_out = buf.size();
+
+		ret = lzma_code(&strm, LZMA_FINISH);
+		if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+		{
+			lzma_end(&strm);
+			throw std::runtime_error("XZ compression failed");
+		}
+
+		// stop at the first difference
+		size_t out_bytes = buf.size() - strm.avail_out;
+		if (out_bytes > orig_length - pos
+				|| memcmp(&buf.front(), orig + pos, out_bytes))
+		{
+			lzma_end(&strm);
+			return false;
+		}
+		pos += out_bytes;
+	}
+	while (ret != LZMA_STREAM_END);
+
+	lzma_end(&strm);
+	return pos == orig_length;
+}
+
+static nested::format expand_xz(const uint8_t* p, size_t length,
+		size_t max_size, std::vector<char>& out, uint32_t& params)
+{
+	size_t pos = xz::stream_header_length;
+
+	// (a zero block header size means the index, i.e. no blocks)
+	if (length <= pos || p[6] != 0 || p[7] & 0xf0 || !p[pos])
+		return nested::none;
+
+	uint32_t check = p[7];
+	size_t header_end = pos + (p[pos] + 1) * 4 - sizeof(uint32_t);
+	uint8_t flags = p[pos + 1];
+
+	if (header_end > length || flags & xz::filter_count_mask
+			|| flags & xz::reserved)
+		return nested::none;
+
+	// the multi-threaded encoder stores both sizes, the single-threaded
+	// one none of them
+	bool threaded = flags & xz::compressed_size;
+	if (threaded != bool(flags & xz::uncompressed_size))
+		return nested::none;
+#ifndef HAVE_LZMA_STREAM_ENCODER_MT
+	// (liblzma older than 5.2 can not reproduce them)
+	if (threaded)
+		return nested::none;
+#endif
+
+	size_t hpos = pos + 2;
+	lzma_vli size, id, props_size;
+
+	if (threaded
+			&& (lzma_vli_decode(&size, 0, p, &hpos, header_end) != LZMA_OK
+				|| lzma_vli_decode(&size, 0, p, &hpos, header_end) != LZMA_OK))
+		return nested::none;
+	if (lzma_vli_decode(&id, 0, p, &hpos, header_end) != LZMA_OK
+			|| id != LZMA_FILTER_LZMA2
+			|| lzma_vli_decode(&props_size, 0, p, &hpos, header_end) != LZMA_OK
+			|| props_size != 1 || hpos >= header_end
+			|| p[hpos] > xz::max_dict_code)
+		return nested::none;
+
+	uint8_t dict_code = p[hpos];
+
+	lzma_stream strm = LZMA_STREAM_INIT;
+	if (lzma_stream_decoder(&strm, UINT64_MAX, 0) != LZMA_OK)
+		throw std::runtime_error("lzma_stream_decoder() failed");
+
+	strm.next_in = p;
+	strm.avail_in = length;
+	out.clear();
+
+	lzma_ret ret = LZMA_OK;
+	while (ret == LZMA_OK && grow(out, 0, max_size))
+	{
+		size_t used = strm.total_out;
+
+		strm.next_out = reinterpret_cast<uint8_t*>(&out[used]);
+		strm.avail_out = out.size() - used;
+
+		ret = lzma_code(&strm, LZMA_FINISH);
+		out.resize(out.size() - strm.avail_out);
+	}
+
+	bool ended = ret == LZMA_STREAM_END && strm.avail_in == 0;
+	lzma_end(&strm);
+
+	if (!ended || out.empty())
+		return nested::none;
+
+	uint32_t dict_size = dict_code == xz::max_dict_code ? UINT32_MAX
+		: (2U | (dict_code & 1)) << (dict_code / 2 + 11);
+
+	// the xz presets, the default one first
+	const uint32_t presets[] = { 6, 0, 1, 2, 3, 4, 5, 7, 8, 9 };
+
+	for (int extreme = 0; extreme < 2; ++extreme)
+	{
+		for (size_t i = 0; i < sizeof(presets) / sizeof(*presets); ++i)
+		{
+			lzma_options_lzma opt;
+			if (lzma_lzma_preset(&opt, presets[i]
+						| (extreme ? LZMA_PRESET_EXTREME : 0)))
+				throw std::runtime_error("lzma_lzma_preset() failed");
+			opt.dict_size = dict_size;
+
+			lzma_filter chain[2];
+			chain[0].id = LZMA_FILTER_LZMA2;
+			chain[0].options = &opt;
+			chain[1].id = LZMA_VLI_UNKNOWN;
+
+			lzma_stream enc = LZMA_STREAM_INIT;
+			lzma_ret init;
+
+#ifdef HAVE_LZMA_STREAM_ENCODER_MT
+			if (threaded)
+			{
+				// (the output does not depend on the thread count)
+				lzma_mt mt;
+				memset(&mt, 0, sizeof(mt));
+				mt.threads = 1;
+				mt.filters = chain;
+				mt.check = static_cast<lzma_check>(check);
+
+				init = lzma_stream_encoder_mt(&enc, &mt);
+			}
+			else
+#endif
+				init = lzma_stream_encoder(&enc, chain,
+						static_cast<lzma_check>(check));
+
+			if (init == LZMA_UNSUPPORTED_CHECK || init == LZMA_OPTIONS_ERROR)
+			{
+				lzma_end(&enc);
+				return nested::none;
+			}
+			if (init != LZMA_OK)
+			{
+				lzma_end(&enc);
+				throw std::runtime_error("Initializing the XZ encoder failed");
+			}
+
+			if (encoder_matches(enc, &out.front(), out.size(), p, length))
+			{
+				params = presets[i]
+					| (extreme ? nested::xz_params::extreme : 0)
+					| (threaded ? nested::xz_params::threaded : 0)
+					| check << nested::xz_params::check_shift
+					| static_cast<uint32_t>(dict_code)
+						<< nested::xz_params::dict_shift;
+				return nested::xz;
+			}
+		}
+	}
+
+	return nested::none;
+}
+
+#endif /*ENABLE_XZ*/
+
+nested::format nested::expand(const void* data, size_t length,
+		size_t max_size, std::vector<char>& out, uint32_t& params)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+
+	switch (detect(data, length))
+	{
+#ifdef ENABLE_ZLIB
+		case gzip:
+			return expand_gzip(p, length, max_size, out, params);
+#endif
+#ifdef ENABLE_XZ
+		case xz:
+			return expand_xz(p, length, max_size, out, params);
+#endif
+		default:
+			return none;
+	}
+}
@@ -0,0 +1,82 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+#ifndef SDT_NESTED_HXX
+#define SDT_NESTED_HXX 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <cstdlib>
+#include <vector>
+
+extern "C"
+{
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+}
+
+/**
+ * Compressed files stored inside the image (e.g. .gz or .xz).
+ *
+ * A file is expanded only if compressing its data again with the detected
+ * parameters reproduces it exactly, so that the original can be rebuilt
+ * from the expanded data and the parameters.
+ */
+
+namespace nested
+{
+	enum format
+	{
+		none = 0,
+		// single-member gzip; the expanded data is the original header
+		// followed by the decompressed data
+		gzip = 1,
+		// single-stream xz with a single LZMA2 filter
+		xz = 2
+	};
+
+	namespace gzip_params
+	{
+		enum gzip_params
+		{
+			level_mask = 0x0f,
+			// (the header length takes all the remaining bits)
+			header_length_shift = 8
+		};
+	}
+
+	namespace xz_params
+	{
+		enum xz_params
+		{
+			preset_mask = 0x0f,
+			extreme = 0x10,
+			// compressed with the multi-threaded encoder
+			// (the sizes are stored in the block headers)
+			threaded = 0x20,
+			check_shift = 8,
+			check_mask = 0x0f << check_shift,
+			// the LZMA2 dictionary size as stored in the filter properties
+			dict_shift = 16,
+			dict_mask = 0xff << dict_shift
+		};
+	}
+
+	// get the format of the compressed data (by the magic)
+	format detect(const void* data, size_t length);
+
+	// decompress the data into out, as long as it fits in max_size
+	// and compressing it again reproduces the data; returns the format
+	// (none if the data can not be expanded) and the parameters
+	format expand(const void* data, size_t length, size_t max_size,
+			std::vector<char>& out, uint32_t& params);
+}
+
+#endif /*!SDT_NESTED_HXX*/
@@ -0,0 +1,274 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "normalize.hxx"
+
+// reference used for inodes that are not in the table
+// (i.e. the field is stored unchanged)
+static const uint64_t invalid_ref = 0;
+
+void MetadataNormalizer::table::load_layout(const MMAPFile& f,
+		uint64_t start, uint64_t end)
+{
+	block_pos = metadata_block_positions(f, start, end);
+	// (only the compressed ones are looked up)
+	for (size_t i = 0; i < block_pos.size(); ++i)
+		blocks[start + block_pos[i] + sizeof(le16)] = i;
+
+	// every block but the last one is metadata_size long
+	if ((data.size() + squashfs::metadata_size - 1)
+			/ squashfs::metadata_size != block_pos.size())
+		throw std::runtime_error("Metadata table size does not match its blocks");
+}
+
+bool MetadataNormalizer::table::in_block(size_t pos, size_t length) const
+{
+	return pos / squashfs::metadata_size
+		== (pos + length - 1) / squashfs::metadata_size;
+}
+
+uint64_t MetadataNormalizer::table::ref(size_t pos) const
+{
+	return static_cast<uint64_t>(block_pos[pos / squashfs::metadata_size]) << 16
+		| pos % squashfs::metadata_size;
+}
+
+bool MetadataNormalizer::table::position(uint32_t start_block,
+		uint16_t offset, size_t* pos) const
+{
+	std::vector<uint32_t>::const_iterator it
+		= std::lower_bound(block_pos.begin(), block_pos.end(), start_block);
+
+	if (it == block_pos.end() || *it != start_block)
+		return false;
+	*pos = (it - block_pos.begin()) * squashfs::metadata_size + offset;
+	return true;
+}
+
+void MetadataNormalizer::normalize_dir_inode(const char* orig,
+		const struct InodeScanner::inode_entry& e, size_t& expected)
+{
+	const char* ip = orig + e.offset;
+	const le32* start_block;
+	const le16* offset;
+	uint32_t file_size;
+
+	if (e.type == squashfs::inode::type::dir)
+	{
+		const squashfs::inode::dir* d
+			= reinterpret_cast<const squashfs::inode::dir*>(ip);
+
+		start_block = &d->start_block;
+		offset = &d->offset;
+		file_size = d->file_size;
+	}
+	else
+	{
+		const squashfs::inode::ldir* d
+			= reinterpret_cast<const squashfs::inode::ldir*>(ip);
+
+		start_block = &d->start_block;
+		offset = &d->offset;
+		file_size = d->file_size;
+	}
+
+	// the listings are written in the order of the directory inodes,
+	// so the listing is expected right after the preceding one
+	uint64_t expected_ref = expected / squashfs::metadata_size
+			< dirs.block_pos.size()
+		? dirs.ref(expected) : invalid_ref;
+	size_t field_pos = reinterpret_cast<const char*>(start_block) - orig;
+
+	if (inodes.in_block(field_pos, sizeof(le32)))
+		*reinterpret_cast<le32*>(&inodes.data[field_pos])
+			= static_cast<uint32_t>(*start_block - (expected_ref >> 16));
+	field_pos = reinterpret_cast<const char*>(offset) - orig;
+	if (inodes.in_block(field_pos, sizeof(le16)))
+		*reinterpret_cast<le16*>(&inodes.data[field_pos])
+			= static_cast<uint16_t>(*offset - (expected_ref & 0xffff));
+
+	// the index of a large directory points to the blocks
+	// of its listing, so store them relative to its start
+	if (e.type == squashfs::inode::type::ldir)
+	{
+		size_t pos = e.offset + squashfs::inode::fixed_size[e.type];
+
+		while (pos + sizeof(struct squashfs::dir_index)
+				<= e.offset + e.length)
+		{
+			const struct squashfs::dir_index* idx
+				= reinterpret_cast<const squashfs::dir_index*>(orig + pos);
+
+			field_pos = pos + sizeof(le32);
+			if (inodes.in_block(field_pos, sizeof(le32)))
+				*reinterpret_cast<le32*>(&inodes.data[field_pos])
+					= static_cast<uint32_t>(idx->start_block - *start_block);
+			pos += sizeof(struct squashfs::dir_index) + idx->size + 1;
+		}
+	}
+
+	// (file_size includes the 3 bytes of the implicit . and .. entries)
+	size_t listing_pos;
+	if (file_size >= 3 && dirs.position(*start_block, *offset, &listing_pos))
+		expected = listing_pos + file_size - 3;
+}
+
+void MetadataNormalizer::normalize_inodes(InodeScanner& ir)
+{
+	size_t length;
+	const char* orig = ir.table(&length);
+	struct InodeScanner::inode_entry e;
+	// end of the furthest data block seen so far
+	uint64_t expected = 0;
+	// end of the listing of the preceding directory
+	size_t dir_expected = 0;
+
+	ir.rewind();
+	while (ir.next_inode(e))
+	{
+		if (e.inode_number < inode_refs.size())
+			inode_refs[e.inode_number] = inodes.ref(e.offset);
+
+		if (e.type == squashfs::inode::type::dir
+				|| e.type == squashfs::inode::type::ldir)
+		{
+			normalize_dir_inode(orig, e, dir_expected);
+			continue;
+		}
+
+		uint64_t start_block;
+		if (e.type == squashfs::inode::type::reg)
+			start_block = reinterpret_cast<const squashfs::inode::reg*>(
+					orig + e.offset)->start_block;
+		else if (e.type == squashfs::inode::type::lreg)
+			start_block = reinterpret_cast<const squashfs::inode::lreg*>(
+					orig + e.offset)->start_block;
+		else
+			continue;
+
+		// (the field follows the common part)
+		size_t field_pos = e.offset + sizeof(squashfs::inode::base);
+		char* field = &inodes.data[field_pos];
+
+		if (e.type == squashfs::inode::type::reg)
+		{
+			if (inodes.in_block(field_pos, sizeof(le32)))
+				*reinterpret_cast<le32*>(field)
+					= static_cast<uint32_t>(start_block - expected);
+		}
+		else if (inodes.in_block(field_pos, sizeof(le64)))
+			*reinterpret_cast<le64*>(field) = start_block - expected;
+
+		// deduplicated files point back, so do not let them
+		// move the prediction backwards
+		size_t fixed = squashfs::inode::fixed_size[e.type];
+		const le32* block_list = reinterpret_cast<const le32*>(
+				orig + e.offset + fixed);
+		uint64_t end = start_block;
+
+		for (size_t i = 0; i < (e.length - fixed) / sizeof(le32); ++i)
+			end += block_list[i] & ~squashfs::block_size::uncompressed;
+		expected = std::max(expected, end);
+	}
+}
+
+void MetadataNormalizer::normalize_dirs()
+{
+	// (the transform is applied in place, so keep the original)
+	const std::vector<char> orig(dirs.data);
+	size_t pos = 0;
+
+	while (pos < orig.size())
+	{
+		if (orig.size() - pos < sizeof(struct squashfs::dir_header))
+			throw std::runtime_error("Invalid directory table");
+
+		const struct squashfs::dir_header* h
+			= reinterpret_cast<const squashfs::dir_header*>(&orig[pos]);
+		uint32_t count = h->count + 1;
+		uint32_t inode_number = h->inode_number;
+		uint64_t ref = inode_number < inode_refs.size()
+			? inode_refs[inode_number] : invalid_ref;
+
+		size_t field_pos = pos + sizeof(le32);
+		if (dirs.in_block(field_pos, sizeof(le32)))
+			*reinterpret_cast<le32*>(&dirs.data[field_pos])
+				= static_cast<uint32_t>(h->start_block - (ref >> 16));
+		pos += sizeof(struct squashfs::dir_header);
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			if (orig.size() - pos < sizeof(struct squashfs::dir_entry))
+				throw std::runtime_error("Invalid directory table");
+
+			const struct squashfs::dir_entry* de
+				= reinterpret_cast<const squashfs::dir_entry*>(&orig[pos]);
+			uint32_t entry_number = inode_number
+				+ static_cast<int16_t>(de->inode_number);
+			uint64_t entry_ref = entry_number < inode_refs.size()
+				? inode_refs[entry_number] : invalid_ref;
+
+			if (dirs.in_block(pos, sizeof(le16)))
+				*reinterpret_cast<le16*>(&dirs.data[pos])
+					= static_cast<uint16_t>(de->offset - (entry_ref & 0xffff));
+
+			pos += sizeof(struct squashfs::dir_entry) + de->size + 1;
+			if (pos > orig.size())
+				throw std::runtime_error("Invalid directory table");
+		}
+	}
+}
+
+void MetadataNormalizer::load(const MMAPFile& f,
+		const squashfs::super_block& sb, Compressor& c,
+		InodeScanner& ir, uint64_t dir_end)
+{
+	size_t length;
+	const char* data = ir.table(&length);
+
+	inodes.data.assign(data, data + length);
+	inodes.load_layout(f, sb.inode_table_start, sb.directory_table_start);
+
+	// (the directory inodes are predicted from the listing positions)
+	MetadataReader dr(f, sb.directory_table_start, c, dir_end);
+	data = dr.peek_all(&length);
+
+	dirs.data.assign(data, data + length);
+	dirs.load_layout(f, sb.directory_table_start, dir_end);
+
+	inode_refs.assign(static_cast<size_t>(sb.inodes) + 1, invalid_ref);
+	normalize_inodes(ir);
+	normalize_dirs();
+}
+
+const char* MetadataNormalizer::lookup(uint64_t offset, size_t* length) const
+{
+	const table* tables[] = { &inodes, &dirs };
+
+	for (size_t i = 0; i < sizeof(tables) / sizeof(*tables); ++i)
+	{
+		std::unordered_map<uint64_t, size_t>::const_iterator it
+			= tables[i]->blocks.find(offset);
+
+		if (it != tables[i]->blocks.end())
+		{
+			size_t pos = it->second * squashfs::metadata_size;
+
+			*length = std::min<size_t>(squashfs::metadata_size,
+					tables[i]->data.size() - pos);
+			return &tables[i]->data[pos];
+		}
+	}
+
+	return 0;
+}
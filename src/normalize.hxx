@@ -0,0 +1,87 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+#ifndef SDT_NORMALIZE_HXX
+#define SDT_NORMALIZE_HXX 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+extern "C"
+{
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+}
+
+#include <unordered_map>
+#include <vector>
+
+#include "compressor.hxx"
+#include "squashfs.hxx"
+#include "util.hxx"
+
+// Position-independent form of the inode and directory tables.
+//
+// The absolute references that shift whenever an earlier file changes
+// size are replaced with their difference from the value predicted
+// from the preceding data:
+//
+// - the start_block of a regular file is stored relative to the end
+//   of the furthest data block of the preceding files,
+// - the start_block and offset of a directory inode are stored relative
+//   to the end of the listing of the preceding directory, and the index
+//   entries of a large directory relative to its start_block,
+// - the start_block of a directory header and the offset of a directory
+//   entry are stored relative to the actual position of the inode
+//   with given number.
+//
+// Only the fields lying within a single block are transformed.
+// The blocks kept verbatim are written as in the image, with their
+// fields unchanged.
+// The predictions use the original values, so the transform can be
+// inverted by walking the tables in the same order.
+class MetadataNormalizer
+{
+	struct table
+	{
+		std::vector<char> data;
+		// positions of the blocks relative to the table start
+		std::vector<uint32_t> block_pos;
+		// data offset of a compressed block in the image -> block number
+		std::unordered_map<uint64_t, size_t> blocks;
+
+		void load_layout(const MMAPFile& f, uint64_t start, uint64_t end);
+
+		bool in_block(size_t pos, size_t length) const;
+		// the inode/directory reference for given position
+		uint64_t ref(size_t pos) const;
+		// the position for given reference, false if no such block
+		bool position(uint32_t start_block, uint16_t offset,
+				size_t* pos) const;
+	};
+
+	table inodes, dirs;
+	// inode number -> reference to the inode
+	std::vector<uint64_t> inode_refs;
+
+	void normalize_dir_inode(const char* orig,
+			const struct InodeScanner::inode_entry& e, size_t& expected);
+	void normalize_inodes(InodeScanner& ir);
+	void normalize_dirs();
+
+public:
+	void load(const MMAPFile& f, const squashfs::super_block& sb,
+			Compressor& c, InodeScanner& ir, uint64_t dir_end);
+
+	// get the normalized data of a compressed metadata block,
+	// or null if the block is not a part of the normalized tables
+	const char* lookup(uint64_t offset, size_t* length) const;
+};
+
+#endif /*!SDT_NORMALIZE_HXX*/
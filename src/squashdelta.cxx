@@ -8,9 +8,13 @@
 #	include "config.h"
 #endif
 
+#include <algorithm>
 #include <iostream>
 #include <list>
 #include <typeinfo>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <cassert>
 #include <cerrno>
@@ -21,13 +25,18 @@
 extern "C"
 {
 #	include <sys/types.h>
+#	include <sys/resource.h>
 #	include <sys/wait.h>
 #	include <unistd.h>
+#	include <getopt.h>
 #	include <arpa/inet.h>
 }
 
 #include "compressor.hxx"
+#include "filter.hxx"
 #include "hash.hxx"
+#include "nested.hxx"
+#include "normalize.hxx"
 #include "squashfs.hxx"
 #include "util.hxx"
 
@@ -37,6 +46,94 @@ struct compressed_block
 	size_t length;
 	size_t uncompressed_length;
 	uint32_t hash;
+	// inode number of the (first) file using the block,
+	// 0 for metadata and fragment blocks
+	uint32_t file;
+	// (data blocks) position of the block in the file
+	size_t file_pos;
+	// stored compressed since re-compression does not reproduce it
+	bool verbatim;
+	// (nested mode) stored uncompressed in the image, the data is moved
+	// to the expanded file as-is (like a verbatim block)
+	bool raw;
+	// (nested mode) belongs to a nested compressed file, so it always
+	// needs to be expanded
+	bool nested;
+	// the branch conversion filter applied to the expanded data
+	filter::type code_filter;
+
+	// (reassembly mode) a fragment block rebuilt from the file tails,
+	// or a tail of a file: tail length bytes at tail_offset
+	// of the fragment block
+	bool reassembled;
+	bool tail;
+	size_t tail_offset;
+	// (per-file mode) the data is in the file data stream
+	bool in_file_stream;
+};
+
+// (per-file mode) the data of a file in the file data stream
+struct file_extent
+{
+	uint32_t file;
+	size_t offset;
+	size_t length;
+};
+
+// (nested mode) a file that starts like a compressed stream
+struct nested_candidate
+{
+	uint32_t inode_number;
+	// all the blocks of the file, including the ones stored uncompressed
+	std::vector<size_t> blocks;
+	// the tail, to tell whether it is found in the other image
+	size_t tail_length;
+	uint32_t tail_hash;
+};
+
+struct nested_candidates
+{
+	std::vector<struct nested_candidate> files;
+	// copies of all the blocks of the files, to list them again
+	// if they were matched
+	std::unordered_map<size_t, struct compressed_block> blocks;
+};
+
+// (nested mode) a compressed file in the file data stream,
+// replaced with its expanded data
+struct nested_file
+{
+	// position in the original stream
+	size_t offset;
+	size_t length;
+	size_t expanded_length;
+	nested::format format;
+	uint32_t params;
+};
+
+// (exec-filters mode) the first data block of a regular file
+struct file_head
+{
+	uint32_t inode_number;
+	size_t offset;
+	// the block size, with the uncompressed bit
+	uint32_t size;
+};
+
+// the compressed data of a regular file
+struct file_data
+{
+	uint32_t inode_number;
+	// offsets of the compressed blocks (in nested mode, of all blocks
+	// of the nested files), in file order
+	std::vector<size_t> blocks;
+	// offset of the compressed fragment block holding the tail (0 if none)
+	size_t fragment_block;
+	size_t tail_offset;
+	size_t tail_length;
+	// the fragment block if it is stored uncompressed (0 if not)
+	size_t raw_fragment_block;
+	size_t raw_fragment_length;
 };
 
 #pragma pack(push, 1)
@@ -54,10 +151,136 @@ struct sqdelta_header
 	uint32_t compression;
 	uint32_t block_count;
 };
+
+// follows the patch header if the compressors differ
+struct sqdelta_target_header
+{
+	uint32_t compression;
+};
+
+// (per-file mode) the delta of a file in the file data stream
+// (64-bit, since the decompressed streams may exceed 4 GiB)
+struct sqdelta_file_record
+{
+	uint64_t length;
+	// the source file data (0, 0 if none)
+	uint64_t source_offset;
+	uint64_t source_length;
+	uint64_t delta_length;
+};
+
+// (nested mode) a compressed file expanded in the file data stream
+struct sqdelta_nested_record
+{
+	// the compressed file in the original file data stream
+	// (the lengths are limited by max_nested_size)
+	uint64_t offset;
+	uint32_t length;
+	uint32_t expanded_length;
+	uint32_t format;
+	uint32_t params;
+};
 #pragma pack(pop)
 
 const uint32_t sqdelta_magic = 0x5371ceb4;
 
+namespace sqdelta_flags
+{
+	enum sqdelta_flags
+	{
+		// the target uses a different compressor than the source,
+		// its compression value follows the patch header
+		target_compression = 0x01,
+		// the expanded inode and directory table blocks
+		// are stored in the position-independent form
+		normalized = 0x02,
+		// the expanded data is ordered by file, with the fragment blocks
+		// split into the tails of the files
+		reassembled = 0x04,
+		// the data of the changed files is diffed file by file,
+		// the per-file records and deltas follow the block list
+		per_file = 0x08,
+		// the code in the data blocks of the executables is converted
+		// by the branch conversion filters
+		filtered = 0x10,
+		// the compressed files inside the image are expanded in the file
+		// data streams, the lists of them precede the per-file records
+		nested = 0x20
+	};
+}
+
+namespace sqdelta_block_flags
+{
+	enum sqdelta_block_flags
+	{
+		// (in uncompressed_length) the block could not be reproduced
+		// by re-compression, so the expanded file contains it compressed
+		verbatim = 0x80000000,
+		// the entry is a file tail, and its length holds the position
+		// of the tail in the fragment block
+		tail = 0x40000000,
+		// the fragment block is not stored, it is rebuilt from its tails
+		reassembled = 0x20000000,
+		// (per-file mode) the data is in the file data stream
+		file_stream = 0x10000000,
+		// the filter::type applied to the expanded data block
+		// (shifted by filter_shift)
+		filter = 0x0c000000
+	};
+
+	const int filter_shift = 26;
+}
+
+// the decompressed data is written densely, so preallocate it in chunks
+const off_t unpacked_prealloc_chunk = 16 * 1024 * 1024;
+
+// how much data to stream before dropping it from the page cache
+const size_t drop_cache_window = 8 * 1024 * 1024;
+
+// how far ahead of the sequential reads to prefetch
+const size_t readahead_window = 4 * 1024 * 1024;
+
+// max chunk to copy between the input and the expanded file
+const size_t copy_chunk_size = 1024 * 1024;
+
+// max number of blocks and input span to decompress in a single batch
+// (the span is kept within the prefetched part of the input)
+const size_t decompress_batch_blocks = 32;
+const size_t decompress_batch_span = readahead_window / 2;
+// max output size of a single batch
+const size_t decompress_batch_size = 4 * 1024 * 1024;
+
+// (per-file mode) min estimated similarity of a renamed file
+const double min_file_similarity = 0.2;
+
+// (nested mode) max expanded size of a nested compressed file,
+// and how many files to try expanding at a time
+const size_t max_nested_size = 16 * 1024 * 1024;
+const size_t nested_batch_files = 16;
+
+// (per-file mode) how many files to diff at a time
+// (their deltas are kept in temporary files until written in order)
+const size_t delta_batch_files = 64;
+
+// (adaptive mode) data blocks with at least keep_min_samples fingerprints,
+// less than 1 in keep_match_ratio of them found in the source, are not
+// expanded in the target
+const size_t keep_min_samples = 4;
+const size_t keep_match_ratio = 20;
+
+// how many blocks to sample for compressor parameter detection
+const size_t detect_sample_count = 16;
+
+// htonl() for the 64-bit fields
+uint64_t htonll(uint64_t v)
+{
+	uint32_t parts[2] = { htonl(v >> 32), htonl(v) };
+	uint64_t ret;
+
+	memcpy(&ret, parts, sizeof(ret));
+	return ret;
+}
+
 bool sort_by_offset(const struct compressed_block& lhs,
 		const struct compressed_block& rhs)
 {
@@ -73,10 +296,113 @@ bool sort_by_len_hash(const struct compressed_block& lhs,
 }
 
 
+long major_faults()
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		return -1;
+	return ru.ru_majflt;
+}
+
+// prefetch the data ahead of the sequential read position,
+// and unmap the data behind it
+void advance_read_window(MMAPFile& f, size_t pos,
+		size_t& prefetched, size_t& released)
+{
+	if (pos + readahead_window / 2 >= prefetched)
+	{
+		if (prefetched < pos)
+			prefetched = pos;
+		f.will_need(prefetched, pos + readahead_window - prefetched);
+		prefetched = pos + readahead_window;
+	}
+
+	// (the reads may go back in reassembly mode)
+	if (pos > released && pos - released >= readahead_window)
+	{
+		f.release(released, pos - released);
+		released = pos;
+	}
+}
+
+// number of metadata blocks needed to store the table entries
+size_t metadata_block_count(size_t entries, size_t entry_size)
+{
+	return (entries * entry_size + squashfs::metadata_size - 1)
+		/ squashfs::metadata_size;
+}
+
+// get the offset of the first metadata block from the table index
+uint64_t read_table_index(const MMAPFile& f, uint64_t index_offset)
+{
+	MMAPFile hf(f);
+
+	hf.seek(index_offset, std::ios::beg);
+	return hf.read<le64>();
+}
+
+// find where the table ends, i.e. the next table starts
+uint64_t table_end(uint64_t start, const std::vector<uint64_t>& table_starts,
+		uint64_t bytes_used)
+{
+	uint64_t end = bytes_used;
+
+	for (std::vector<uint64_t>::const_iterator i = table_starts.begin();
+			i != table_starts.end(); ++i)
+	{
+		if (*i > start && *i < end)
+			end = *i;
+	}
+
+	return end;
+}
+
+// record the compressed blocks of a metadata table, either the given
+// number of blocks or up to the end offset; returns the block count
+size_t record_metadata_blocks(const MMAPFile& f, uint64_t start,
+		size_t count, std::list<struct compressed_block>& out,
+		uint64_t end = 0)
+{
+	// (the compressor is not used for raw reads)
+	MMAPFile hf(f);
+	hf.seek(start, std::ios::beg);
+
+	size_t n;
+	for (n = 0; count ? n < count : hf.getpos() < end; ++n)
+	{
+		uint16_t header = hf.read<le16>();
+		size_t length = header & ~squashfs::inode_size::uncompressed;
+		size_t pos = hf.getpos();
+		const void* data = hf.read_array<char>(length);
+
+		assert(length != 0);
+		if (!(header & squashfs::inode_size::uncompressed))
+		{
+			struct compressed_block block;
+			block.offset = pos;
+			block.length = length;
+			block.hash = murmurhash3(data, length, 0);
+			block.file = 0;
+			block.raw = false;
+			block.nested = false;
+
+			out.push_back(block);
+		}
+	}
+
+	return n;
+}
+
+// the compressor is allocated separately for each file, since
+// the source and the target may use different algorithms
 std::list<struct compressed_block> get_blocks(MMAPFile& f, Compressor*& c,
-		size_t& block_size)
+		size_t& block_size, size_t prefetch_distance,
+		MetadataNormalizer* norm, std::vector<struct file_data>* files,
+		DirectoryTable* dirs, std::vector<struct file_head>* heads)
 {
-	const squashfs::super_block& sb = f.read<squashfs::super_block>();
+	// (copy it since the mapping may be windowed)
+	const squashfs::super_block sb = f.read<squashfs::super_block>();
 
 	if (sb.s_magic != squashfs::magic)
 		throw std::runtime_error(
@@ -84,284 +410,1813 @@ std::list<struct compressed_block> get_blocks(MMAPFile& f, Compressor*& c,
 	if (sb.s_major != 4 || sb.s_minor != 0)
 		throw std::runtime_error("File is not SquashFS 4.0");
 
-	if (!block_size)
-		block_size = sb.block_size;
-	else if (block_size != sb.block_size)
-		throw std::runtime_error("Input files have different block sizes");
+	block_size = sb.block_size;
 
 	switch (sb.compression)
 	{
 		case squashfs::compression::lzo:
 #ifdef ENABLE_LZO
-			if (!c)
-				c = new LZOCompressor();
-			else if (typeid(*c) != typeid(LZOCompressor))
-				throw std::runtime_error("The two files use different compressors");
+			c = new LZOCompressor();
 #else
 			throw std::runtime_error("LZO compression support disabled at build time");
 #endif
 			break;
 		case squashfs::compression::lz4:
 #ifdef ENABLE_LZ4
-			if (!c)
-				c = new LZ4Compressor();
-			else if (typeid(*c) != typeid(LZ4Compressor))
-				throw std::runtime_error("The two files use different compressors");
+			c = new LZ4Compressor();
 #else
 			throw std::runtime_error("LZ4 compression support disabled at build time");
 #endif
 			break;
+		case squashfs::compression::zstd:
+#ifdef ENABLE_ZSTD
+			c = new ZstdCompressor();
+#else
+			throw std::runtime_error("zstd compression support disabled at build time");
+#endif
+			break;
+		case squashfs::compression::xz:
+#ifdef ENABLE_XZ
+			c = new XZCompressor(sb.block_size);
+#else
+			throw std::runtime_error("XZ compression support disabled at build time");
+#endif
+			break;
+		case squashfs::compression::zlib:
+#ifdef ENABLE_ZLIB
+			c = new ZlibCompressor();
+#else
+			throw std::runtime_error("zlib compression support disabled at build time");
+#endif
+			break;
+		case squashfs::compression::lzma:
+			// mksquashfs uses the LZMA SDK encoder that liblzma
+			// does not reproduce bit-exactly
+			throw std::runtime_error("Legacy LZMA compression is not supported"
+					" (re-compression can not be reproduced)");
 		default:
 			throw std::runtime_error("Unsupported compression algorithm.");
 	}
 
-	MetadataReader coptsr(f, sizeof(sb), *c);
-	c->setup(sb.flags & squashfs::flags::compression_options
-			? &coptsr : 0);
-	coptsr.block_num();
+	MetadataReader coptsr(f, sizeof(sb), *c);
+	c->setup(sb.flags & squashfs::flags::compression_options
+			? &coptsr : 0);
+	coptsr.block_num();
+
+	std::list<struct compressed_block>
+		compressed_metadata_blocks,
+		compressed_data_blocks;
+
+	std::cerr << "Reading inodes..." << std::endl;
+
+	InodeScanner ir(f, sb, *c);
+	struct InodeScanner::file in;
+
+	std::vector<uint32_t> file_fragments;
+
+	while (ir.next_file(in))
+	{
+		uint64_t pos = in.start_block;
+		uint32_t block_count = in.block_count;
+		const le32* block_list = in.block_list;
+
+		struct file_data* fd = 0;
+		if (files)
+		{
+			files->push_back(file_data());
+			fd = &files->back();
+			fd->inode_number = in.inode_number;
+			fd->fragment_block = 0;
+			fd->raw_fragment_block = 0;
+			fd->raw_fragment_length = 0;
+			fd->tail_offset = in.fragment_offset;
+			fd->tail_length = in.fragment != squashfs::invalid_frag
+				? in.file_size & (block_size - 1) : 0;
+			file_fragments.push_back(in.fragment);
+		}
+
+		// (sparse first blocks are not executables either)
+		if (heads && block_count && block_list[0])
+		{
+			struct file_head h = { in.inode_number, pos, block_list[0] };
+			heads->push_back(h);
+		}
+
+		for (uint32_t j = 0; j < block_count; ++j)
+		{
+			if (block_list[j] & squashfs::block_size::uncompressed)
+			{
+				// seek over the uncompressed block
+				uint32_t len = (block_list[j]
+						& ~squashfs::block_size::uncompressed);
+				assert(len != 0);
+				pos += len;
+			}
+			// if length == 0, it indicates a sparse block
+			else if (block_list[j] != 0)
+			{
+				// record the compressed block
+				struct compressed_block block;
+				block.offset = pos;
+				block.length = block_list[j];
+				block.file = in.inode_number;
+				block.file_pos = static_cast<size_t>(j) * block_size;
+				block.raw = false;
+				block.nested = false;
+
+				compressed_data_blocks.push_back(block);
+				if (fd)
+					fd->blocks.push_back(pos);
+				pos += block.length;
+			}
+		}
+	}
+
+	size_t block_num = ir.block_num();
+	std::cerr << "Read " << sb.inodes << " inodes in "
+		<< block_num << " blocks.\n";
+
+	// record inode blocks
+
+	std::cerr << "Hashing " << block_num
+		<< " inode blocks..." << std::endl;
+
+	record_metadata_blocks(f, sb.inode_table_start, block_num,
+			compressed_metadata_blocks);
+
+	// fragments
+	std::cerr << "Reading fragment table..." << std::endl;
+
+	FragmentTableReader fr(f, sb, *c);
+	// fragment block offsets and sizes
+	std::vector<std::pair<size_t, uint32_t> > fragment_blocks;
+
+	for (uint32_t i = 0; i < sb.fragments; ++i)
+	{
+		const struct squashfs::fragment_entry& fe = fr.read();
+		assert(fe.size != 0);
+
+		if (!(fe.size & squashfs::block_size::uncompressed))
+		{
+			struct compressed_block block;
+			block.offset = fe.start_block;
+			block.length = fe.size;
+			block.file = 0;
+			block.raw = false;
+			block.nested = false;
+
+			compressed_data_blocks.push_back(block);
+		}
+
+		if (files)
+			fragment_blocks.push_back(std::make_pair(
+						static_cast<size_t>(fe.start_block),
+						static_cast<uint32_t>(fe.size)));
+	}
+
+	// the files can be told their fragment blocks now
+	for (size_t i = 0; i < file_fragments.size(); ++i)
+	{
+		struct file_data& fd = (*files)[i];
+
+		if (fd.tail_length)
+		{
+			if (file_fragments[i] >= fragment_blocks.size())
+				throw std::runtime_error("Fragment index out of range");
+
+			const std::pair<size_t, uint32_t>& fb
+				= fragment_blocks[file_fragments[i]];
+			if (fb.second & squashfs::block_size::uncompressed)
+			{
+				fd.raw_fragment_block = fb.first;
+				fd.raw_fragment_length = fb.second
+					& ~squashfs::block_size::uncompressed;
+			}
+			else
+				fd.fragment_block = fb.first;
+		}
+	}
+
+	block_num = fr.block_num();
+	std::cerr << "Read " << sb.fragments << " fragments in "
+		<< block_num << " blocks.\n";
+
+	// record fragment table
+
+	std::cerr << "Hashing " << block_num
+		<< " fragment table blocks..." << std::endl;
+
+	record_metadata_blocks(f, fr.start_offset, block_num,
+			compressed_metadata_blocks);
+
+	// the remaining metadata tables
+
+	std::vector<uint64_t> table_starts;
+	table_starts.push_back(sb.fragment_table_start);
+	if (sb.fragments)
+		table_starts.push_back(fr.start_offset);
+
+	size_t id_blocks = metadata_block_count(sb.no_ids,
+			squashfs::entry_size::id);
+	uint64_t id_start = read_table_index(f, sb.id_table_start);
+	table_starts.push_back(sb.id_table_start);
+	table_starts.push_back(id_start);
+
+	size_t lookup_blocks = 0;
+	uint64_t lookup_start = squashfs::invalid_table;
+	if (sb.lookup_table_start != squashfs::invalid_table)
+	{
+		lookup_blocks = metadata_block_count(sb.inodes,
+				squashfs::entry_size::lookup);
+		lookup_start = read_table_index(f, sb.lookup_table_start);
+		table_starts.push_back(sb.lookup_table_start);
+		table_starts.push_back(lookup_start);
+	}
+
+	size_t xattr_id_blocks = 0;
+	uint64_t xattr_start = squashfs::invalid_table;
+	uint64_t xattr_id_start = squashfs::invalid_table;
+	if (sb.xattr_id_table_start != squashfs::invalid_table)
+	{
+		MMAPFile xf(f);
+		xf.seek(sb.xattr_id_table_start, std::ios::beg);
+		const squashfs::xattr_id_table xt
+			= xf.read<squashfs::xattr_id_table>();
+
+		xattr_start = xt.xattr_table_start;
+		xattr_id_blocks = metadata_block_count(xt.xattr_ids,
+				squashfs::entry_size::xattr_id);
+		xattr_id_start = xf.read<le64>();
+		table_starts.push_back(sb.xattr_id_table_start);
+		table_starts.push_back(xattr_start);
+		table_starts.push_back(xattr_id_start);
+	}
+
+	// the directory table and the xattr key/value table have no index,
+	// they end where the following table starts
+	uint64_t dir_end = table_end(sb.directory_table_start,
+			table_starts, sb.bytes_used);
+
+	std::cerr << "Hashing directory, id, export and xattr tables..."
+		<< std::endl;
+
+	block_num = record_metadata_blocks(f, sb.directory_table_start, 0,
+			compressed_metadata_blocks, dir_end);
+	block_num += record_metadata_blocks(f, id_start, id_blocks,
+			compressed_metadata_blocks);
+	if (lookup_blocks)
+		block_num += record_metadata_blocks(f, lookup_start, lookup_blocks,
+				compressed_metadata_blocks);
+	if (xattr_id_blocks)
+	{
+		block_num += record_metadata_blocks(f, xattr_start, 0,
+				compressed_metadata_blocks,
+				table_end(xattr_start, table_starts, sb.bytes_used));
+		block_num += record_metadata_blocks(f, xattr_id_start,
+				xattr_id_blocks, compressed_metadata_blocks);
+	}
+
+	std::cerr << "Read " << block_num << " blocks.\n";
+
+	if (norm)
+	{
+		std::cerr << "Normalizing inode and directory tables..."
+			<< std::endl;
+		norm->load(f, sb, *c, ir, dir_end);
+	}
+
+	if (dirs)
+	{
+		std::cerr << "Reading directory tree..." << std::endl;
+		dirs->load(f, sb, *c, ir, dir_end);
+	}
+
+	// sort by offset to use sequential reads
+	compressed_data_blocks.sort(sort_by_offset);
+
+	std::cerr << "Hashing " << compressed_data_blocks.size()
+		<< " data blocks..." << std::endl;
+	MMAPFile hf(f);
+	size_t prefetched = 0, released = 0;
+
+	hf.set_access_pattern(MMAPFile::sequential);
+
+	Prefetcher pf(f, prefetch_distance);
+	for (std::list<struct compressed_block>::iterator
+			i = compressed_data_blocks.begin();
+			i != compressed_data_blocks.end(); ++i)
+		pf.push((*i).offset, (*i).length);
+	pf.start();
+
+	// record the checksums and perform initial deduplication
+	for (std::list<struct compressed_block>::iterator
+			i = compressed_data_blocks.begin(),
+			j = compressed_data_blocks.end();
+			i != compressed_data_blocks.end();)
+	{
+		// duplicates will be adjacent after sorting
+		if ((*i).offset == ((*j).offset))
+		{
+			assert((*i).length == (*j).length);
+			i = compressed_data_blocks.erase(i);
+			continue;
+		}
+
+		advance_read_window(hf, (*i).offset, prefetched, released);
+		pf.advance((*i).offset);
+
+		hf.seek((*i).offset, std::ios::beg);
+		(*i).hash = murmurhash3(hf.read_array<uint8_t>((*i).length),
+				(*i).length, 0);
+		j = i++;
+	}
+
+	pf.stop();
+	hf.set_access_pattern(MMAPFile::normal);
+
+	compressed_data_blocks.splice(compressed_data_blocks.end(),
+			compressed_metadata_blocks);
+
+	// copy a sample of blocks evenly spread through the image,
+	// since the mapping may be windowed
+	std::vector<std::vector<char> > samples;
+	size_t sample_step = compressed_data_blocks.size()
+		/ detect_sample_count + 1;
+	size_t n = 0;
+
+	for (std::list<struct compressed_block>::iterator
+			i = compressed_data_blocks.begin();
+			i != compressed_data_blocks.end(); ++i, ++n)
+	{
+		if (n % sample_step)
+			continue;
+
+		hf.seek((*i).offset, std::ios::beg);
+		const char* data = hf.read_array<char>((*i).length);
+		samples.push_back(std::vector<char>(data, data + (*i).length));
+	}
+
+	std::cerr << "Detecting compression parameters using "
+		<< samples.size() << " blocks..." << std::endl;
+	c->detect(samples, std::max<size_t>(block_size,
+				squashfs::metadata_size));
+
+	std::cerr << "Total: " << compressed_data_blocks.size()
+		<< " compressed blocks (" << major_faults()
+		<< " major page faults so far)." << std::endl;
+
+	return compressed_data_blocks;
+}
+
+// get the filters for the code of the files that have blocks in cb,
+// looking at the ELF headers in their first blocks (which may be
+// matched in the other image, and so not expanded)
+std::unordered_map<uint32_t, filter::type> detect_executables(
+		MMAPFile& f, Compressor& c, size_t block_size,
+		const std::list<struct compressed_block>& cb,
+		const std::vector<struct file_head>& heads)
+{
+	std::unordered_map<uint32_t, filter::type> ret;
+
+	for (std::list<struct compressed_block>::const_iterator i = cb.begin();
+			i != cb.end(); ++i)
+	{
+		if ((*i).file)
+			ret[(*i).file] = filter::none;
+	}
+
+	std::vector<const struct file_head*> todo;
+	for (std::vector<struct file_head>::const_iterator i = heads.begin();
+			i != heads.end(); ++i)
+	{
+		if (ret.find((*i).inode_number) != ret.end())
+			todo.push_back(&*i);
+	}
+
+	// (the decompressor is not thread-safe, so the blocks are
+	// decompressed in batches, and only checked in parallel)
+	size_t batch_blocks = std::min(decompress_batch_blocks,
+			std::max<size_t>(decompress_batch_size / block_size, 1));
+	std::vector<char> src(batch_blocks * block_size);
+	std::vector<char> dest(batch_blocks * block_size);
+	std::vector<struct decompress_slot> slots(batch_blocks);
+	std::vector<filter::type> found(batch_blocks);
+	// the (decompressed) data of each block
+	std::vector<const char*> data(batch_blocks);
+	std::vector<size_t> lengths(batch_blocks);
+	MMAPFile hf(f);
+	size_t executables = 0;
+
+	for (size_t i = 0; i < todo.size(); i += batch_blocks)
+	{
+		size_t count = std::min(batch_blocks, todo.size() - i);
+		size_t compressed = 0;
+
+		// (copied, since the mapping may be windowed)
+		for (size_t k = 0; k < count; ++k)
+		{
+			const struct file_head& h = *todo[i + k];
+			uint32_t length = h.size & ~squashfs::block_size::uncompressed;
+
+			if (length > block_size)
+				throw std::runtime_error("Data block larger than the block size");
+			hf.seek(h.offset, std::ios::beg);
+			memcpy(&src[k * block_size], hf.read_array<char>(length), length);
+			data[k] = &src[k * block_size];
+			lengths[k] = length;
+
+			if (!(h.size & squashfs::block_size::uncompressed))
+			{
+				struct decompress_slot& slot = slots[compressed++];
+				slot.src = data[k];
+				slot.length = length;
+				slot.dest = &dest[k * block_size];
+				slot.out_size = block_size;
+				data[k] = &dest[k * block_size];
+			}
+		}
+
+		c.decompress_batch(&slots.front(), compressed);
+
+		compressed = 0;
+		for (size_t k = 0; k < count; ++k)
+		{
+			if (!(todo[i + k]->size & squashfs::block_size::uncompressed))
+				lengths[k] = slots[compressed++].out_bytes;
+		}
+
+		parallel_for(count, [&](size_t k)
+		{
+			found[k] = filter::detect_elf(data[k], lengths[k]);
+		});
+
+		for (size_t k = 0; k < count; ++k)
+		{
+			ret[todo[i + k]->inode_number] = found[k];
+			if (found[k] != filter::none)
+				++executables;
+		}
+	}
+
+	std::cerr << "Found " << executables << " executables to filter.\n";
+	return ret;
+}
+
+typedef std::list<struct compressed_block>::iterator block_iter;
+
+// (nested mode) find the files that start like compressed streams,
+// and record all their blocks (including the ones stored uncompressed
+// and the fragment blocks holding the tails) so that the changed ones
+// can be listed whole after the matching; the data blocks stored
+// uncompressed are added to cb, so that they are matched as well
+void find_nested_files(MMAPFile& f, Compressor& c, size_t block_size,
+		std::list<struct compressed_block>& cb,
+		std::vector<struct file_data>& files,
+		struct nested_candidates& nested)
+{
+	std::unordered_map<size_t, block_iter> blocks;
+	for (block_iter i = cb.begin(); i != cb.end(); ++i)
+		blocks[(*i).offset] = i;
+
+	std::unordered_map<uint32_t, struct file_data*> file_map;
+	for (std::vector<struct file_data>::iterator i = files.begin();
+			i != files.end(); ++i)
+		file_map[(*i).inode_number] = &*i;
+
+	MMAPFile hf(f);
+	hf.seek(0, std::ios::beg);
+	const squashfs::super_block sb = hf.read<squashfs::super_block>();
+
+	InodeScanner ir(f, sb, c);
+	struct InodeScanner::file in;
+	std::vector<char> buf(block_size);
+	// the last decompressed fragment block
+	std::vector<char> fragment(block_size);
+	size_t fragment_offset = 0;
+	size_t fragment_length = 0;
+
+	// decompress a listed block into out
+	auto decompress = [&](const struct compressed_block& b,
+			std::vector<char>& out)
+	{
+		hf.seek(b.offset, std::ios::beg);
+
+		struct decompress_slot slot;
+		slot.src = hf.read_array<char>(b.length);
+		slot.length = b.length;
+		slot.dest = &out.front();
+		slot.out_size = out.size();
+
+		c.decompress_batch(&slot, 1);
+		return slot.out_bytes;
+	};
+
+	// get the tail of the file (null if none or unreadable)
+	auto read_tail = [&](const struct file_data& fd) -> const char*
+	{
+		if (!fd.tail_length)
+			return 0;
+
+		if (fd.fragment_block)
+		{
+			std::unordered_map<size_t, block_iter>::iterator
+				b = blocks.find(fd.fragment_block);
+
+			if (b == blocks.end())
+				return 0;
+			if (fragment_offset != fd.fragment_block)
+			{
+				fragment_length = decompress(*b->second, fragment);
+				fragment_offset = fd.fragment_block;
+			}
+			if (fd.tail_offset + fd.tail_length > fragment_length)
+				return 0;
+
+			return &fragment[fd.tail_offset];
+		}
+		else if (fd.raw_fragment_block)
+		{
+			if (fd.tail_offset + fd.tail_length > fd.raw_fragment_length)
+				return 0;
+
+			hf.seek(fd.raw_fragment_block + fd.tail_offset, std::ios::beg);
+			return hf.read_array<char>(fd.tail_length);
+		}
+
+		return 0;
+	};
+
+	// record a copy of the block, to be listed again if matched
+	auto record = [&](const struct compressed_block& b)
+	{
+		struct compressed_block copy = b;
+		copy.nested = true;
+		nested.blocks.insert(std::make_pair(b.offset, copy));
+	};
+
+	while (ir.next_file(in))
+	{
+		std::unordered_map<uint32_t, struct file_data*>::iterator
+			fi = file_map.find(in.inode_number);
+
+		if (fi == file_map.end() || in.file_size > max_nested_size)
+			continue;
+
+		struct file_data& fd = *fi->second;
+		const char* head;
+		size_t head_length;
+
+		// look at the first bytes of the file
+		if (in.block_count)
+		{
+			uint32_t length = in.block_list[0]
+				& ~squashfs::block_size::uncompressed;
+
+			if (in.block_list[0] & squashfs::block_size::uncompressed)
+			{
+				hf.seek(in.start_block, std::ios::beg);
+				head = hf.read_array<char>(length);
+				head_length = length;
+			}
+			else
+			{
+				std::unordered_map<size_t, block_iter>::iterator
+					b = blocks.find(in.start_block);
+
+				if (!length || b == blocks.end())
+					continue;
+				head = &buf.front();
+				head_length = decompress(*b->second, buf);
+			}
+		}
+		else
+		{
+			head = read_tail(fd);
+			head_length = fd.tail_length;
+			if (!head)
+				continue;
+		}
+
+		if (nested::detect(head, head_length) == nested::none)
+			continue;
+
+		// the whole file is needed, so no sparse blocks
+		if (std::count(in.block_list, in.block_list + in.block_count, 0))
+			continue;
+
+		struct nested_candidate nc;
+		nc.inode_number = in.inode_number;
+		nc.tail_length = fd.tail_length;
+		nc.tail_hash = 0;
+
+		if (fd.tail_length)
+		{
+			const char* tail = read_tail(fd);
+			if (!tail)
+				continue;
+			nc.tail_hash = murmurhash3(tail, fd.tail_length, 0);
+		}
+
+		uint64_t pos = in.start_block;
+		for (uint32_t j = 0; j < in.block_count; ++j)
+		{
+			uint32_t length = in.block_list[j]
+				& ~squashfs::block_size::uncompressed;
+
+			if (in.block_list[j] & squashfs::block_size::uncompressed
+					&& !blocks.count(pos))
+			{
+				hf.seek(pos, std::ios::beg);
+
+				struct compressed_block block = compressed_block();
+				block.offset = pos;
+				block.length = length;
+				block.hash = murmurhash3(hf.read_array<char>(length),
+						length, 0);
+				block.file = in.inode_number;
+				block.file_pos = static_cast<size_t>(j) * block_size;
+				block.raw = true;
+				block.nested = true;
+
+				cb.push_back(block);
+				blocks[pos] = --cb.end();
+			}
+
+			std::unordered_map<size_t, block_iter>::iterator
+				b = blocks.find(pos);
+			if (b != blocks.end())
+				record(*b->second);
+
+			nc.blocks.push_back(pos);
+			pos += length;
+		}
+
+		if (fd.tail_length)
+		{
+			if (fd.fragment_block)
+				record(*blocks[fd.fragment_block]);
+			else
+			{
+				struct compressed_block block = compressed_block();
+				block.offset = fd.raw_fragment_block;
+				block.length = fd.raw_fragment_length;
+				block.hash = 0;
+				block.file = 0;
+				block.raw = true;
+				block.nested = true;
+
+				record(block);
+			}
+		}
+
+		nested.files.push_back(nc);
+	}
+
+	std::cerr << "Found " << nested.files.size()
+		<< " nested compressed files.\n";
+}
+
+// (nested mode) list all the blocks of the nested files that have
+// any block not matched, or a tail not found in the other image
+// (other), so that the whole files get into the file data stream
+void list_nested_files(std::list<struct compressed_block>& cb,
+		std::vector<struct file_data>& files,
+		const struct nested_candidates& nested,
+		const struct nested_candidates& other)
+{
+	std::unordered_map<size_t, block_iter> blocks;
+	for (block_iter i = cb.begin(); i != cb.end(); ++i)
+		blocks[(*i).offset] = i;
+
+	std::unordered_map<uint32_t, struct file_data*> file_map;
+	for (std::vector<struct file_data>::iterator i = files.begin();
+			i != files.end(); ++i)
+		file_map[(*i).inode_number] = &*i;
+
+	std::unordered_set<uint64_t> other_tails;
+	for (std::vector<struct nested_candidate>::const_iterator
+			i = other.files.begin(); i != other.files.end(); ++i)
+	{
+		if ((*i).tail_length)
+			other_tails.insert(static_cast<uint64_t>((*i).tail_length) << 32
+					| (*i).tail_hash);
+	}
+
+	size_t count = 0;
+
+	for (std::vector<struct nested_candidate>::const_iterator
+			i = nested.files.begin(); i != nested.files.end(); ++i)
+	{
+		const struct nested_candidate& nc = *i;
+		bool changed = nc.tail_length && !other_tails.count(
+				static_cast<uint64_t>(nc.tail_length) << 32 | nc.tail_hash);
+
+		for (std::vector<size_t>::const_iterator j = nc.blocks.begin();
+				!changed && j != nc.blocks.end(); ++j)
+			changed = blocks.count(*j);
+
+		if (!changed)
+			continue;
+
+		struct file_data& fd = *file_map[nc.inode_number];
+		fd.blocks = nc.blocks;
+
+		std::vector<size_t> file_blocks(fd.blocks);
+		if (nc.tail_length)
+			file_blocks.push_back(fd.fragment_block
+					? fd.fragment_block : fd.raw_fragment_block);
+
+		for (std::vector<size_t>::iterator j = file_blocks.begin();
+				j != file_blocks.end(); ++j)
+		{
+			std::unordered_map<size_t, block_iter>::iterator
+				b = blocks.find(*j);
+
+			if (b != blocks.end())
+				(*b->second).nested = true;
+			else
+			{
+				// (matched, or a fragment block stored uncompressed)
+				std::unordered_map<size_t, struct compressed_block>
+					::const_iterator copy = nested.blocks.find(*j);
+
+				if (copy == nested.blocks.end())
+					throw std::logic_error("Block of a nested file not recorded");
+				cb.push_back(copy->second);
+				blocks[*j] = --cb.end();
+			}
+		}
+
+		++count;
+	}
+
+	// the tails in the uncompressed fragment blocks listed now
+	// can be split as well
+	for (std::vector<struct file_data>::iterator i = files.begin();
+			i != files.end(); ++i)
+	{
+		if ((*i).raw_fragment_block && blocks.count((*i).raw_fragment_block))
+			(*i).fragment_block = (*i).raw_fragment_block;
+	}
+
+	std::cerr << count << " of " << nested.files.size()
+		<< " nested compressed files changed.\n";
+}
+
+// an entry of the expanded data
+struct expand_item
+{
+	block_iter block;
+	// inode number of the file (0 for metadata)
+	uint32_t file;
+	// (reassembly mode) a file tail from a fragment block
+	bool tail;
+	size_t tail_offset;
+	size_t tail_length;
+};
+
+// a fragment block being split into the file tails
+struct fragment_state
+{
+	// the length covered by the tails (0 if they leave gaps)
+	size_t covered;
+	// the tails not written yet
+	size_t refs;
+	bool started;
+	bool reassembled;
+	std::vector<char> data;
+};
+
+// order the blocks by file, replacing the fragment blocks
+// with the tails of the files
+void order_by_file(std::list<struct compressed_block>& cb,
+		const std::vector<struct file_data>& files,
+		std::vector<struct expand_item>& items,
+		std::unordered_map<size_t, struct fragment_state>& fragments)
+{
+	std::unordered_map<size_t, block_iter> pending;
+	std::unordered_map<size_t, std::vector<std::pair<size_t, size_t> > >
+		tails;
+
+	for (block_iter i = cb.begin(); i != cb.end(); ++i)
+		pending[(*i).offset] = i;
+
+	for (std::vector<struct file_data>::const_iterator f = files.begin();
+			f != files.end(); ++f)
+	{
+		for (std::vector<size_t>::const_iterator j = (*f).blocks.begin();
+				j != (*f).blocks.end(); ++j)
+		{
+			// (the blocks shared by multiple files are written once)
+			std::unordered_map<size_t, block_iter>::iterator b
+				= pending.find(*j);
+
+			if (b != pending.end())
+			{
+				struct expand_item it = { b->second, (*f).inode_number,
+					false, 0, 0 };
+				items.push_back(it);
+				pending.erase(b);
+			}
+		}
+
+		if ((*f).fragment_block)
+		{
+			std::unordered_map<size_t, block_iter>::iterator b
+				= pending.find((*f).fragment_block);
+
+			if (b != pending.end())
+			{
+				struct expand_item it = { b->second, (*f).inode_number,
+					true, (*f).tail_offset, (*f).tail_length };
+				items.push_back(it);
+				tails[(*f).fragment_block].push_back(std::make_pair(
+							(*f).tail_offset, (*f).tail_length));
+			}
+		}
+	}
+
+	// the remaining blocks (metadata) follow in offset order
+	for (block_iter i = cb.begin(); i != cb.end(); ++i)
+	{
+		if (pending.count((*i).offset) && !tails.count((*i).offset))
+		{
+			struct expand_item it = { i, 0, false, 0, 0 };
+			items.push_back(it);
+		}
+	}
+
+	for (std::unordered_map<size_t,
+				std::vector<std::pair<size_t, size_t> > >::iterator
+			i = tails.begin(); i != tails.end(); ++i)
+	{
+		std::vector<std::pair<size_t, size_t> >& t = i->second;
+		struct fragment_state& fs = fragments[i->first];
+
+		std::sort(t.begin(), t.end());
+		fs.covered = 0;
+		for (std::vector<std::pair<size_t, size_t> >::iterator j = t.begin();
+				j != t.end(); ++j)
+		{
+			if ((*j).first > fs.covered)
+			{
+				fs.covered = 0;
+				break;
+			}
+			fs.covered = std::max(fs.covered, (*j).first + (*j).second);
+		}
+
+		fs.refs = t.size();
+		fs.started = false;
+		fs.reassembled = false;
+	}
+}
+
+// find the slot holding given block (or count if none)
+size_t find_slot(const std::vector<block_iter>& slot_blocks, size_t count,
+		size_t offset)
+{
+	size_t n;
+
+	for (n = 0; n < count; ++n)
+	{
+		if ((*slot_blocks[n]).offset == offset)
+			break;
+	}
+	return n;
+}
+
+// order the files by path (instead of the inode table order)
+void sort_files_by_path(std::vector<struct file_data>& files,
+		const DirectoryTable& dirs)
+{
+	std::vector<std::pair<std::string, size_t> > paths;
+
+	paths.reserve(files.size());
+	for (size_t i = 0; i < files.size(); ++i)
+		paths.push_back(std::make_pair(dirs.path(files[i].inode_number), i));
+	std::sort(paths.begin(), paths.end());
+
+	std::vector<struct file_data> sorted;
+	sorted.reserve(files.size());
+	for (size_t i = 0; i < paths.size(); ++i)
+		sorted.push_back(files[paths[i].second]);
+	files.swap(sorted);
+}
+
+// count the files having blocks in the list
+size_t count_files(const std::list<struct compressed_block>& cb)
+{
+	std::vector<uint32_t> ids;
+
+	for (std::list<struct compressed_block>::const_iterator i = cb.begin();
+			i != cb.end(); ++i)
+	{
+		if ((*i).file)
+			ids.push_back((*i).file);
+	}
+
+	std::sort(ids.begin(), ids.end());
+	return std::unique(ids.begin(), ids.end()) - ids.begin();
+}
+
+// print the paths of the files having blocks in the list
+void list_files(const std::list<struct compressed_block>& cb,
+		const DirectoryTable& dirs, const char* label)
+{
+	std::vector<std::string> paths;
+	uint32_t prev = 0;
+
+	for (std::list<struct compressed_block>::const_iterator i = cb.begin();
+			i != cb.end(); ++i)
+	{
+		// (the blocks of a file are adjacent in offset order)
+		if ((*i).file && (*i).file != prev)
+			paths.push_back(dirs.path((*i).file));
+		prev = (*i).file;
+	}
+
+	std::sort(paths.begin(), paths.end());
+	paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+
+	for (std::vector<std::string>::iterator i = paths.begin();
+			i != paths.end(); ++i)
+		std::cerr << label << ": " << *i << "\n";
+}
+
+// copy the data in chunks to keep windowed mappings small
+void copy_data(SparseFileWriter& outf, MMAPFile& inf, size_t length)
+{
+	while (length > 0)
+	{
+		size_t chunk = std::min(length, copy_chunk_size);
+
+		outf.write(inf.read_array<char>(chunk), chunk);
+		length -= chunk;
+	}
+}
+
+void write_unpacked_file(SparseFileWriter& outf, MMAPFile& inf,
+		std::list<struct compressed_block>& cb, Compressor& c,
+		size_t block_size, bool drop_cache, size_t prefetch_distance,
+		bool verify, const MetadataNormalizer* norm,
+		const std::vector<struct file_data>* files,
+		SparseFileWriter* file_stream, std::vector<struct file_extent>* extents,
+		FingerprintIndex* fingerprints, bool keep_dissimilar,
+		const std::unordered_map<uint32_t, filter::type>* file_filters)
+{
+	size_t prev_offset = 0;
+	inf.seek(0, std::ios::beg);
+	inf.set_access_pattern(MMAPFile::sequential);
+
+	// the copy reads the whole file sequentially
+	Prefetcher copy_pf(inf, prefetch_distance);
+	copy_pf.push(0, inf.getlen());
+	copy_pf.start();
+	size_t copy_prefetched = 0, copy_released = 0;
+
+	for (std::list<struct compressed_block>::iterator i = cb.begin();
+			i != cb.end(); ++i)
+	{
+		assert((*i).offset >= prev_offset);
+		advance_read_window(inf, prev_offset, copy_prefetched, copy_released);
+		copy_pf.advance(prev_offset);
+
+		size_t pre_length = (*i).offset - prev_offset;
+		prev_offset = (*i).offset + (*i).length;
+
+		// first, copy the data preceeding compressed block
+		copy_data(outf, inf, pre_length);
+
+		// then, seek through the block
+		inf.seek((*i).length);
+		outf.write_sparse((*i).length);
+	}
+
+	// write the last block
+	copy_data(outf, inf, inf.getlen() - prev_offset);
+	copy_pf.stop();
+
+	outf.preallocate(unpacked_prealloc_chunk);
+
+	std::vector<struct expand_item> items;
+	std::unordered_map<size_t, struct fragment_state> fragments;
+
+	if (files)
+		order_by_file(cb, *files, items, fragments);
+	else
+	{
+		for (block_iter i = cb.begin(); i != cb.end(); ++i)
+		{
+			struct expand_item it = { i, 0, false, 0, 0 };
+			items.push_back(it);
+		}
+	}
+
+	// while the decompression reads only the compressed blocks; the
+	// prefetching and the read window follow the offsets, so they are
+	// not used when the blocks are read in file order
+	bool offset_order = !files;
+	Prefetcher pf(inf, offset_order ? prefetch_distance : 0);
+	for (block_iter i = cb.begin(); i != cb.end(); ++i)
+		pf.push((*i).offset, (*i).length);
+	pf.start();
+
+	// metadata blocks may be larger than the data blocks
+	size_t buf_size = std::max<size_t>(block_size, squashfs::metadata_size);
+	size_t batch_blocks = std::min(decompress_batch_blocks,
+			std::max<size_t>(decompress_batch_size / buf_size, 1));
+
+	std::vector<char> arena(batch_blocks * buf_size);
+	std::vector<struct decompress_slot> slots(batch_blocks);
+	std::vector<block_iter> slot_blocks(batch_blocks);
+
+	std::vector<char> verified(batch_blocks, true);
+	size_t verbatim_blocks = 0;
+	// the filters for the code of the executables
+	std::vector<filter::type> slot_filters(batch_blocks, filter::none);
+	size_t filtered_blocks = 0;
+	// (adaptive mode) the sampled fingerprints of the data blocks
+	std::vector<std::vector<uint32_t> > prints(batch_blocks);
+	size_t kept_blocks = 0;
+	// the blocks in the order of the expanded data
+	std::list<struct compressed_block> out_blocks;
+
+	size_t dropped = 0;
+	size_t prefetched = 0, released = 0;
+
+	// (drop cache mode) the lowest offset of the blocks from each
+	// item on
+	std::vector<size_t> pending_offsets;
+	if (drop_cache)
+	{
+		pending_offsets.resize(items.size());
+		size_t lowest = inf.getlen();
+		for (size_t i = items.size(); i-- > 0;)
+		{
+			lowest = std::min(lowest, (*items[i].block).offset);
+			pending_offsets[i] = lowest;
+		}
+	}
+
+	// write a whole decompressed (or verbatim) block from given slot
+	size_t file_stream_pos = 0;
+
+	// write the data of given file, either to the expanded file
+	// or (in per-file mode) to the file data stream
+	auto write_data = [&](struct compressed_block& b, const void* data,
+			size_t length, uint32_t file)
+	{
+		b.in_file_stream = file_stream && file;
+		if (!b.in_file_stream)
+		{
+			outf.write(data, length);
+			return;
+		}
+
+		file_stream->write(data, length);
+		if (extents->empty() || extents->back().file != file)
+		{
+			struct file_extent e = { file, file_stream_pos, 0 };
+			extents->push_back(e);
+		}
+		extents->back().length += length;
+		file_stream_pos += length;
+	};
+
+	// whether the data has no plausible match in the source
+	auto dissimilar = [&](size_t n)
+	{
+		return prints[n].size() >= keep_min_samples
+			&& fingerprints->count_matches(prints[n]) * keep_match_ratio
+				< prints[n].size();
+	};
+
+	auto write_block = [&](struct compressed_block& b, size_t n,
+			uint32_t file)
+	{
+		// (the nested files need all their data to be expanded)
+		bool keep = !b.nested && keep_dissimilar && verified[n]
+			&& dissimilar(n);
+
+		b.verbatim = b.raw || !verified[n] || keep;
+		b.code_filter = b.verbatim ? filter::none : slot_filters[n];
+		b.reassembled = false;
+		b.tail = false;
+		if (b.verbatim)
+		{
+			// keep the block compressed
+			b.uncompressed_length = b.length;
+			write_data(b, slots[n].src, b.length, file);
+			if (keep)
+				++kept_blocks;
+			else if (!b.raw)
+				++verbatim_blocks;
+		}
+		else
+		{
+			const char* out = &arena[n * buf_size];
+			size_t length;
+
+			// write the metadata in the position-independent form
+			// (the verbatim blocks are kept as in the image)
+			const char* norm_out = norm
+				? norm->lookup(b.offset, &length) : 0;
+			if (norm_out)
+			{
+				if (length != slots[n].out_bytes)
+					throw std::runtime_error("Normalized metadata block size mismatch");
+				out = norm_out;
+			}
+
+			b.uncompressed_length = slots[n].out_bytes;
+			write_data(b, out, slots[n].out_bytes, file);
+
+			if (fingerprints && !keep_dissimilar)
+				fingerprints->add(prints[n]);
+			if (b.code_filter != filter::none)
+				++filtered_blocks;
+		}
+		out_blocks.push_back(b);
+	};
+
+	for (size_t i = 0; i < items.size();)
+	{
+		size_t batch_start = i;
+		size_t start = 0;
+		size_t end = 0;
+		size_t count = 0;
+
+		// collect the following blocks that can be read in one go
+		for (; i < items.size() && count < batch_blocks; ++i)
+		{
+			const struct compressed_block& b = *items[i].block;
+
+			// the tails of the fragment blocks decompressed already
+			if (items[i].tail && fragments[b.offset].started)
+				continue;
+			if (find_slot(slot_blocks, count, b.offset) != count)
+				continue;
+
+			size_t new_start = count ? std::min(start, b.offset) : b.offset;
+			size_t new_end = std::max(end, b.offset + b.length);
+			if (count && new_end - new_start > decompress_batch_span)
+				break;
+
+			start = new_start;
+			end = new_end;
+			slot_blocks[count++] = items[i].block;
+		}
+
+		if (count)
+		{
+			if (offset_order)
+			{
+				advance_read_window(inf, start, prefetched, released);
+				pf.advance(start);
+			}
+
+			inf.seek(start, std::ios::beg);
+			const char* data = inf.read_array<char>(end - start);
+
+			// (the raw blocks go last, since they are not decompressed)
+			size_t compressed = std::stable_partition(slot_blocks.begin(),
+					slot_blocks.begin() + count,
+					[](block_iter b) { return !(*b).raw; })
+				- slot_blocks.begin();
+
+			for (size_t n = 0; n < count; ++n)
+			{
+				slots[n].src = data + ((*slot_blocks[n]).offset - start);
+				slots[n].length = (*slot_blocks[n]).length;
+				slots[n].dest = &arena[n * buf_size];
+				slots[n].out_size = buf_size;
+			}
+
+			c.decompress_batch(&slots.front(), compressed);
+			for (size_t n = compressed; n < count; ++n)
+			{
+				memcpy(slots[n].dest, slots[n].src, slots[n].length);
+				slots[n].out_bytes = slots[n].length;
+			}
+
+			if (file_filters)
+			{
+				for (size_t k = 0; k < count; ++k)
+				{
+					std::unordered_map<uint32_t, filter::type>::const_iterator
+						f = file_filters->find((*slot_blocks[k]).file);
+
+					slot_filters[k] = f != file_filters->end()
+						? f->second : filter::none;
+				}
+			}
+
+			if (verify || file_filters || fingerprints)
+			{
+				parallel_for(count, [&](size_t k)
+				{
+					const struct decompress_slot& s = slots[k];
+
+					// check whether the blocks re-compress to the same data
+					if (verify && k < compressed)
+					{
+						// (some compressors fail with a tight output buffer)
+						std::vector<char> cbuf(std::max(s.length, s.out_bytes));
+
+						verified[k] = c.compress(&cbuf.front(), s.dest,
+									s.out_bytes, cbuf.size()) == s.length
+							&& !memcmp(&cbuf.front(), s.src, s.length);
+					}
+
+					// (after the verification, which needs the original data)
+					if (slot_filters[k] != filter::none)
+						filter::convert(slot_filters[k], s.dest, s.out_bytes,
+								(*slot_blocks[k]).file_pos, true);
+
+					// sample the data blocks for the similarity estimation
+					if (fingerprints)
+					{
+						if ((*slot_blocks[k]).file)
+							FingerprintIndex::sample(s.dest, s.out_bytes,
+									prints[k]);
+						else
+							prints[k].clear();
+					}
+				});
+			}
+		}
+
+		for (size_t k = batch_start; k < i; ++k)
+		{
+			const struct expand_item& it = items[k];
+			struct compressed_block& b = *it.block;
+			size_t n = find_slot(slot_blocks, count, b.offset);
+
+			if (!it.tail)
+			{
+				write_block(b, n, it.file);
+				continue;
+			}
+
+			struct fragment_state& fs = fragments[b.offset];
+			if (!fs.started)
+			{
+				fs.started = true;
+				// the block can be split only if the tails cover it whole
+				fs.reassembled = (b.raw || verified[n])
+					&& fs.covered == slots[n].out_bytes;
+
+				if (fs.reassembled)
+				{
+					const char* out = &arena[n * buf_size];
+
+					b.uncompressed_length = slots[n].out_bytes;
+					// (an uncompressed block is rebuilt as-is)
+					b.verbatim = b.raw;
+					b.code_filter = filter::none;
+					b.reassembled = true;
+					b.tail = false;
+					b.in_file_stream = false;
+					out_blocks.push_back(b);
+					fs.data.assign(out, out + slots[n].out_bytes);
+				}
+				else
+					write_block(b, n, it.file);
+			}
+
+			if (fs.reassembled)
+			{
+				struct compressed_block t = b;
+				t.uncompressed_length = it.tail_length;
+				t.reassembled = false;
+				t.tail = true;
+				t.tail_offset = it.tail_offset;
+
+				write_data(t, &fs.data[it.tail_offset], it.tail_length,
+						it.file);
+				out_blocks.push_back(t);
+			}
+
+			// free the block after its last tail
+			if (--fs.refs == 0)
+				std::vector<char>().swap(fs.data);
+		}
+
+		// the input behind the lowest block left is not going to be
+		// read again (when ordered by file, the later blocks may lie
+		// before the current batch)
+		if (drop_cache)
+		{
+			size_t pending = i < items.size() ? pending_offsets[i]
+				: inf.getlen();
+
+			if (pending > dropped && pending - dropped >= drop_cache_window)
+			{
+				inf.drop_cache(dropped, pending - dropped);
+				dropped = pending;
+			}
+		}
+	}
+
+	cb.swap(out_blocks);
+
+	if (drop_cache)
+		inf.drop_cache(dropped, inf.getlen() - dropped);
+	inf.set_access_pattern(MMAPFile::normal);
+
+	if (verbatim_blocks)
+		std::cerr << verbatim_blocks << " blocks do not re-compress"
+			" identically and are kept compressed.\n";
+	if (kept_blocks)
+		std::cerr << kept_blocks << " blocks have no similar data in source"
+			" and are kept compressed.\n";
+	if (filtered_blocks)
+		std::cerr << filtered_blocks << " blocks of executable code"
+			" are filtered.\n";
+}
+
+// copy a range of the file (using pread(), so it can be done
+// from multiple threads)
+void copy_range(int fd, size_t offset, size_t length, SparseFileWriter& out)
+{
+	std::vector<char> buf(std::min(length, copy_chunk_size));
+
+	while (length > 0)
+	{
+		ssize_t rd = pread(fd, &buf.front(),
+				std::min(length, buf.size()), offset);
+
+		if (rd == -1)
+			throw IOError("pread() failed", errno);
+		if (rd == 0)
+			throw std::runtime_error("Unexpected EOF in the file data stream");
+
+		out.write(&buf.front(), rd);
+		offset += rd;
+		length -= rd;
+	}
+}
+
+// read a range of the file (using pread(), like copy_range())
+void read_range(int fd, size_t offset, size_t length, char* out)
+{
+	while (length > 0)
+	{
+		ssize_t rd = pread(fd, out, length, offset);
 
-	std::list<struct compressed_block>
-		compressed_metadata_blocks,
-		compressed_data_blocks;
+		if (rd == -1)
+			throw IOError("pread() failed", errno);
+		if (rd == 0)
+			throw std::runtime_error("Unexpected EOF in the file data stream");
 
-	std::cerr << "Reading inodes..." << std::endl;
+		out += rd;
+		offset += rd;
+		length -= rd;
+	}
+}
 
-	InodeReader ir(f, sb, *c);
+// whether two ranges of the same length have the same contents
+bool same_range(int fd1, size_t offset1, int fd2, size_t offset2,
+		size_t length)
+{
+	std::vector<char> buf1(std::min(length, copy_chunk_size));
+	std::vector<char> buf2(buf1.size());
+
+	while (length > 0)
+	{
+		size_t chunk = std::min(length, buf1.size());
+
+		read_range(fd1, offset1, chunk, &buf1.front());
+		read_range(fd2, offset2, chunk, &buf2.front());
+		if (memcmp(&buf1.front(), &buf2.front(), chunk))
+			return false;
+		offset1 += chunk;
+		offset2 += chunk;
+		length -= chunk;
+	}
+
+	return true;
+}
+
+// copy the file data stream, expanding the nested compressed files
+// that can be reproduced; the extents are updated to the new stream
+void expand_nested_files(int fd, std::vector<struct file_extent>& extents,
+		SparseFileWriter& out, std::vector<struct nested_file>& nested_files)
+{
+	size_t out_pos = 0;
 
-	for (uint32_t i = 0; i < sb.inodes; ++i)
+	for (size_t i = 0; i < extents.size(); i += nested_batch_files)
 	{
-		union squashfs::inode::inode& in = ir.read();
+		size_t count = std::min(nested_batch_files, extents.size() - i);
+		std::vector<std::vector<char> > expanded(count);
+		std::vector<struct nested_file> found(count);
 
-		if (in.as_base.inode_type == squashfs::inode::type::reg
-				|| in.as_base.inode_type == squashfs::inode::type::lreg)
+		parallel_for(count, [&](size_t k)
 		{
-			uint32_t pos;
-			uint32_t block_count;
-			le32* block_list;
+			const struct file_extent& e = extents[i + k];
+			char magic[8];
+			size_t magic_length = std::min(e.length, sizeof(magic));
 
-			if (in.as_base.inode_type == squashfs::inode::type::reg)
-			{
-				pos = in.as_reg.start_block;
-				block_count = in.as_reg.block_count(sb.block_size, sb.block_log);
-				block_list = in.as_reg.block_list();
-			}
-			else
-			{
-				pos = in.as_lreg.start_block;
-				block_count = in.as_lreg.block_count(sb.block_size, sb.block_log);
-				block_list = in.as_lreg.block_list();
-			}
+			found[k].format = nested::none;
+			read_range(fd, e.offset, magic_length, magic);
+			if (nested::detect(magic, magic_length) == nested::none)
+				return;
+
+			std::vector<char> data(e.length);
+			read_range(fd, e.offset, e.length, &data.front());
+
+			found[k].format = nested::expand(&data.front(), data.size(),
+					max_nested_size, expanded[k], found[k].params);
+		});
+
+		for (size_t k = 0; k < count; ++k)
+		{
+			struct file_extent& e = extents[i + k];
 
-			for (uint32_t j = 0; j < block_count; ++j)
+			if (found[k].format != nested::none)
 			{
-				if (block_list[j] & squashfs::block_size::uncompressed)
-				{
-					// seek over the uncompressed block
-					uint32_t len = (block_list[j]
-							& ~squashfs::block_size::uncompressed);
-					assert(len != 0);
-					pos += len;
-				}
-				// if length == 0, it indicates a sparse block
-				else if (block_list[j] != 0)
-				{
-					// record the compressed block
-					struct compressed_block block;
-					block.offset = pos;
-					block.length = block_list[j];
+				found[k].offset = e.offset;
+				found[k].length = e.length;
+				found[k].expanded_length = expanded[k].size();
+				nested_files.push_back(found[k]);
 
-					compressed_data_blocks.push_back(block);
-					pos += block.length;
-				}
+				out.write(&expanded[k].front(), expanded[k].size());
+				e.length = expanded[k].size();
 			}
+			else
+				copy_range(fd, e.offset, e.length, out);
+
+			e.offset = out_pos;
+			out_pos += e.length;
 		}
 	}
 
-	size_t block_num = ir.block_num();
-	std::cerr << "Read " << sb.inodes << " inodes in "
-		<< block_num << " blocks.\n";
-
-	// record inode blocks
+	std::cerr << "Expanded " << nested_files.size()
+		<< " nested compressed files." << std::endl;
+}
 
-	std::cerr << "Hashing " << block_num
-		<< " inode blocks..." << std::endl;
+void write_nested_list(SparseFileWriter& outf,
+		const std::vector<struct nested_file>& nested_files)
+{
+	uint32_t count = htonl(nested_files.size());
+	outf.write(count);
 
-	MetadataBlockReader mir(f, sb.inode_table_start, *c);
-	for (size_t i = 0; i < block_num; ++i)
+	for (std::vector<struct nested_file>::const_iterator
+			i = nested_files.begin(); i != nested_files.end(); ++i)
 	{
-		const void* data;
-		size_t pos;
-		size_t length;
-		bool compressed;
+		struct sqdelta_nested_record r;
 
-		mir.read_input_block(&data, &pos, &length, &compressed);
-		assert(length != 0);
+		r.offset = htonll((*i).offset);
+		r.length = htonl((*i).length);
+		r.expanded_length = htonl((*i).expanded_length);
+		r.format = htonl((*i).format);
+		r.params = htonl((*i).params);
 
-		if (compressed)
-		{
-			struct compressed_block block;
-			block.offset = pos;
-			block.length = length;
-			block.hash = murmurhash3(data, length, 0);
+		outf.write<struct sqdelta_nested_record>(r);
+	}
+}
 
-			compressed_metadata_blocks.push_back(block);
-		}
+// run xdelta3 writing the delta to output (source may be null)
+void run_xdelta(const char* source, const char* target, const char* output)
+{
+	pid_t child = fork();
+	if (child == -1)
+		throw IOError("fork() failed", errno);
+	if (child == 0)
+	{
+		// (the process is multi-threaded, so do nothing but exec)
+		if (source)
+			execlp("xdelta3", "xdelta3", "-q", "-f", "-9", "-S", "djw",
+					"-s", source, target, output,
+					static_cast<const char*>(0));
+		else
+			execlp("xdelta3", "xdelta3", "-q", "-f", "-9", "-S", "djw",
+					target, output, static_cast<const char*>(0));
+		_exit(127);
 	}
 
-	// fragments
-	std::cerr << "Reading fragment table..." << std::endl;
+	int status;
+	if (waitpid(child, &status, 0) == -1)
+		throw IOError("waitpid() failed", errno);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		throw std::runtime_error("xdelta3 failed to diff a file");
+}
 
-	FragmentTableReader fr(f, sb, *c);
+// the content signature of a file in the file data stream
+struct file_signature
+{
+	uint32_t hash;
+	MinHashSketch sketch;
+};
 
-	for (uint32_t i = 0; i < sb.fragments; ++i)
+// compute the signatures of the files (in parallel)
+std::vector<struct file_signature> compute_signatures(int fd,
+		const std::vector<struct file_extent>& extents)
+{
+	std::vector<struct file_signature> ret(extents.size());
+
+	parallel_for(extents.size(), [&](size_t i)
 	{
-		const struct squashfs::fragment_entry& fe = fr.read();
-		assert(fe.size != 0);
+		std::vector<char> buf(copy_chunk_size);
+		size_t offset = extents[i].offset;
+		size_t length = extents[i].length;
 
-		if (!(fe.size & squashfs::block_size::uncompressed))
+		ret[i].hash = 0;
+		while (length > 0)
 		{
-			struct compressed_block block;
-			block.offset = fe.start_block;
-			block.length = fe.size;
-
-			compressed_data_blocks.push_back(block);
+			ssize_t rd = pread(fd, &buf.front(),
+					std::min(length, buf.size()), offset);
+
+			if (rd == -1)
+				throw IOError("pread() failed", errno);
+			if (rd == 0)
+				throw std::runtime_error("Unexpected EOF in the file data stream");
+
+			ret[i].hash = murmurhash3(&buf.front(), rd, ret[i].hash);
+			ret[i].sketch.update(&buf.front(), rd);
+			offset += rd;
+			length -= rd;
 		}
-	}
+	});
 
-	block_num = fr.block_num();
-	std::cerr << "Read " << sb.fragments << " fragments in "
-		<< block_num << " blocks.\n";
+	return ret;
+}
 
-	// record fragment table
+// find the source counterpart of every target file (-1 if none):
+// the file with the same path, or (for renamed and moved files)
+// the one with the same or the most similar content
+std::vector<long> pair_files(
+		int source_fd, const std::vector<struct file_extent>& source_extents,
+		int target_fd, const std::vector<struct file_extent>& target_extents,
+		const DirectoryTable& source_dirs, const DirectoryTable& target_dirs)
+{
+	std::unordered_map<std::string, long> source_paths;
+	std::vector<long> ret(target_extents.size(), -1);
+	size_t unpaired = 0;
 
-	std::cerr << "Hashing " << block_num
-		<< " fragment table blocks..." << std::endl;
+	// (the files not found in the tree are paired by content only)
+	for (size_t i = 0; i < source_extents.size(); ++i)
+	{
+		std::string path = source_dirs.path(source_extents[i].file);
 
-	MetadataBlockReader mfr(f, fr.start_offset, *c);
-	for (size_t i = 0; i < block_num; ++i)
+		if (!path.empty())
+			source_paths[path] = i;
+	}
+
+	for (size_t i = 0; i < target_extents.size(); ++i)
 	{
-		const void* data;
-		size_t pos;
-		size_t length;
-		bool compressed;
+		std::string path = target_dirs.path(target_extents[i].file);
+		std::unordered_map<std::string, long>::iterator s
+			= path.empty() ? source_paths.end() : source_paths.find(path);
 
-		mir.read_input_block(&data, &pos, &length, &compressed);
+		if (s != source_paths.end())
+			ret[i] = s->second;
+		else
+			++unpaired;
+	}
 
-		if (compressed)
-		{
-			struct compressed_block block;
-			block.offset = pos;
-			block.length = length;
-			block.hash = murmurhash3(data, length, 0);
+	if (!unpaired || source_extents.empty())
+		return ret;
+
+	std::cerr << "Looking for " << unpaired
+		<< " renamed files by content..." << std::endl;
 
-			compressed_metadata_blocks.push_back(block);
+	std::vector<struct file_signature> source_sigs
+		= compute_signatures(source_fd, source_extents);
+	std::vector<struct file_extent> unpaired_extents;
+	std::vector<size_t> unpaired_index;
+
+	for (size_t i = 0; i < target_extents.size(); ++i)
+	{
+		if (ret[i] == -1)
+		{
+			unpaired_extents.push_back(target_extents[i]);
+			unpaired_index.push_back(i);
 		}
 	}
 
-	// sort by offset to use sequential reads
-	compressed_data_blocks.sort(sort_by_offset);
+	std::vector<struct file_signature> target_sigs
+		= compute_signatures(target_fd, unpaired_extents);
 
-	std::cerr << "Hashing " << compressed_data_blocks.size()
-		<< " data blocks..." << std::endl;
-	MMAPFile hf(f);
+	// index the source files by content hash and by sketch values
+	std::unordered_multimap<uint32_t, long> by_hash;
+	std::unordered_map<uint32_t, std::vector<long> > by_value;
 
-	// record the checksums and perform initial deduplication
-	for (std::list<struct compressed_block>::iterator
-			i = compressed_data_blocks.begin(),
-			j = compressed_data_blocks.end();
-			i != compressed_data_blocks.end();)
+	for (size_t i = 0; i < source_sigs.size(); ++i)
 	{
-		// duplicates will be adjacent after sorting
-		if ((*i).offset == ((*j).offset))
+		by_hash.insert(std::make_pair(source_sigs[i].hash, i));
+
+		const std::vector<uint32_t>& v = source_sigs[i].sketch.get_values();
+		for (std::vector<uint32_t>::const_iterator j = v.begin();
+				j != v.end(); ++j)
+			by_value[*j].push_back(i);
+	}
+
+	size_t by_content = 0;
+	for (size_t i = 0; i < target_sigs.size(); ++i)
+	{
+		const struct file_signature& ts = target_sigs[i];
+		long best = -1;
+
+		// identical content first
+		auto range = by_hash.equal_range(ts.hash);
+		for (auto j = range.first; j != range.second; ++j)
 		{
-			assert((*i).length == (*j).length);
-			i = compressed_data_blocks.erase(i);
-			continue;
+			if (source_extents[j->second].length
+					== unpaired_extents[i].length)
+			{
+				best = j->second;
+				break;
+			}
 		}
 
-		hf.seek((*i).offset, std::ios::beg);
-		(*i).hash = murmurhash3(hf.read_array<uint8_t>((*i).length),
-				(*i).length, 0);
-		j = i++;
-	}
+		if (best == -1)
+		{
+			// then the most similar of the files sharing any shingles
+			std::unordered_map<long, size_t> candidates;
+			const std::vector<uint32_t>& v = ts.sketch.get_values();
 
-	compressed_data_blocks.splice(compressed_data_blocks.end(),
-			compressed_metadata_blocks);
+			for (std::vector<uint32_t>::const_iterator j = v.begin();
+					j != v.end(); ++j)
+			{
+				std::unordered_map<uint32_t, std::vector<long> >::iterator
+					s = by_value.find(*j);
 
-	std::cerr << "Total: " << compressed_data_blocks.size()
-		<< " compressed blocks." << std::endl;
+				if (s != by_value.end())
+				{
+					for (std::vector<long>::iterator k = s->second.begin();
+							k != s->second.end(); ++k)
+						++candidates[*k];
+				}
+			}
 
-	return compressed_data_blocks;
+			double best_similarity = min_file_similarity;
+			for (std::unordered_map<long, size_t>::iterator
+					j = candidates.begin(); j != candidates.end(); ++j)
+			{
+				double sim = ts.sketch.similarity(
+						source_sigs[j->first].sketch);
+
+				if (sim >= best_similarity)
+				{
+					best = j->first;
+					best_similarity = sim;
+				}
+			}
+		}
+
+		if (best != -1)
+		{
+			ret[unpaired_index[i]] = best;
+			++by_content;
+		}
+	}
+
+	std::cerr << "Paired " << by_content << " files by content.\n";
+	return ret;
 }
 
-void write_unpacked_file(SparseFileWriter& outf, MMAPFile& inf,
-		std::list<struct compressed_block>& cb, Compressor& c,
-		size_t block_size)
+// diff the data of the changed files file by file, and write
+// the records followed by the deltas
+void write_file_deltas(SparseFileWriter& outf,
+		int source_fd, const std::vector<struct file_extent>& source_extents,
+		int target_fd, const std::vector<struct file_extent>& target_extents,
+		const std::vector<long>& pairs)
 {
-	size_t prev_offset = 0;
-	inf.seek(0, std::ios::beg);
+	std::vector<size_t> delta_lengths(target_extents.size(), 0);
+	// the deltas in order, until the records are written
+	TemporarySparseFileWriter deltas;
+	size_t unchanged = 0;
 
-	for (std::list<struct compressed_block>::iterator i = cb.begin();
-			i != cb.end(); ++i)
+	deltas.open();
+	for (size_t i = 0; i < target_extents.size(); i += delta_batch_files)
 	{
-		assert((*i).offset >= prev_offset);
+		size_t count = std::min(delta_batch_files,
+				target_extents.size() - i);
+		std::vector<TemporarySparseFileWriter> delta_temps(count);
+		std::vector<char> same(count, 0);
 
-		size_t pre_length = (*i).offset - prev_offset;
-		prev_offset = (*i).offset + (*i).length;
+		parallel_for(count, [&](size_t k)
+		{
+			const struct file_extent& te = target_extents[i + k];
+			long pair = pairs[i + k];
+			TemporarySparseFileWriter source_temp, target_temp;
+
+			// (the tails of a changed fragment block bring
+			// the unchanged files along)
+			if (pair != -1 && source_extents[pair].length == te.length
+					&& same_range(source_fd, source_extents[pair].offset,
+						target_fd, te.offset, te.length))
+			{
+				same[k] = 1;
+				return;
+			}
 
-		// first, copy the data preceeding compressed block
-		outf.write(inf.read_array<char>(pre_length), pre_length);
+			target_temp.open();
+			copy_range(target_fd, te.offset, te.length, target_temp);
+			if (pair != -1)
+			{
+				const struct file_extent& se = source_extents[pair];
 
-		// then, seek through the block
-		inf.seek((*i).length);
-		outf.write_sparse((*i).length);
-	}
+				source_temp.open();
+				copy_range(source_fd, se.offset, se.length, source_temp);
+			}
+			delta_temps[k].open();
 
-	// write the last block
-	outf.write(inf.read_array<char>(inf.getlen() - prev_offset),
-			inf.getlen() - prev_offset);
+			run_xdelta(pair != -1 ? source_temp.name() : 0,
+					target_temp.name(), delta_temps[k].name());
+		});
 
-	char* buf = new char[block_size];
-	try
-	{
-		for (std::list<struct compressed_block>::iterator i = cb.begin();
-				i != cb.end(); ++i)
+		for (size_t k = 0; k < count; ++k)
 		{
-			size_t unc_length;
-
-			inf.seek((*i).offset, std::ios::beg);
-			unc_length = c.decompress(buf, inf.read_array<char>((*i).length),
-					(*i).length, block_size);
+			if (same[k])
+			{
+				++unchanged;
+				continue;
+			}
 
-			(*i).uncompressed_length = unc_length;
-			outf.write(buf, unc_length);
+			MMAPFile df;
+			df.open(delta_temps[k].name());
+			delta_lengths[i + k] = df.getlen();
+			deltas.write(df.read_array<char>(df.getlen()), df.getlen());
 		}
 	}
-	catch (std::exception& e)
+
+	if (unchanged > 0)
+		std::cerr << "Skipped " << unchanged
+			<< " files identical to their source.\n";
+
+	uint32_t count = htonl(target_extents.size());
+	outf.write(count);
+
+	size_t deltas_length = 0;
+	for (size_t i = 0; i < target_extents.size(); ++i)
 	{
-		delete[] buf;
-		throw;
+		struct sqdelta_file_record r;
+
+		r.length = htonll(target_extents[i].length);
+		r.source_offset = htonll(pairs[i] != -1
+				? source_extents[pairs[i]].offset : 0);
+		r.source_length = htonll(pairs[i] != -1
+				? source_extents[pairs[i]].length : 0);
+		r.delta_length = htonll(delta_lengths[i]);
+		deltas_length += delta_lengths[i];
+
+		outf.write<struct sqdelta_file_record>(r);
 	}
-	delete[] buf;
+
+	copy_range(deltas.fd, 0, deltas_length, outf);
+	deltas.close();
 }
 
 void write_block_list(SparseFileWriter& outf, sqdelta_header h,
-		std::list<struct compressed_block>& cb, bool at_end = true)
+		std::list<struct compressed_block>& cb, bool at_end = true,
+		uint32_t target_compression = 0)
 {
 	// store the block count in header
 	h.block_count = htonl(cb.size());
 
 	if (!at_end)
+	{
 		outf.write<struct sqdelta_header>(h);
 
+		if (ntohl(h.flags) & sqdelta_flags::target_compression)
+		{
+			struct sqdelta_target_header th;
+			th.compression = htonl(target_compression);
+
+			outf.write<struct sqdelta_target_header>(th);
+		}
+	}
+
 	for (std::list<struct compressed_block>::iterator i = cb.begin();
 			i != cb.end(); ++i)
 	{
 		struct serialized_compressed_block b;
 
 		b.offset = htonl((*i).offset);
-		b.length = htonl((*i).length);
-		b.uncompressed_length = htonl((*i).uncompressed_length);
+		uint32_t stream_flag = (*i).in_file_stream ? static_cast<uint32_t>(
+				sqdelta_block_flags::file_stream) : 0U;
+
+		if ((*i).tail)
+		{
+			b.length = htonl((*i).tail_offset);
+			b.uncompressed_length = htonl((*i).uncompressed_length
+					| sqdelta_block_flags::tail | stream_flag);
+		}
+		else
+		{
+			b.length = htonl((*i).length);
+			b.uncompressed_length = htonl((*i).uncompressed_length
+					| ((*i).verbatim ? static_cast<uint32_t>(
+							sqdelta_block_flags::verbatim) : 0U)
+					| ((*i).reassembled ? static_cast<uint32_t>(
+							sqdelta_block_flags::reassembled) : 0U)
+					| (static_cast<uint32_t>((*i).code_filter)
+						<< sqdelta_block_flags::filter_shift)
+					| stream_flag);
+		}
 
 		outf.write<struct serialized_compressed_block>(b);
 	}
@@ -370,17 +2225,169 @@ void write_block_list(SparseFileWriter& outf, sqdelta_header h,
 		outf.write<struct sqdelta_header>(h);
 }
 
+static const struct option long_opts[] = {
+	{ "drop-cache", no_argument, 0, 'd' },
+	{ "exec-filters", no_argument, 0, 'x' },
+	{ "huge-pages", no_argument, 0, 'H' },
+	{ "jobs", required_argument, 0, 'j' },
+	{ "list-files", no_argument, 0, 'l' },
+	{ "mmap-window", required_argument, 0, 'w' },
+	{ "nested", no_argument, 0, 'z' },
+	{ "no-verify", no_argument, 0, 'n' },
+	{ "normalize", no_argument, 0, 'N' },
+	{ "per-file", no_argument, 0, 'f' },
+	{ "populate", no_argument, 0, 'p' },
+	{ "adaptive", no_argument, 0, 'a' },
+	{ "reassemble", no_argument, 0, 'r' },
+	{ "sort-by-path", no_argument, 0, 's' },
+	{ "prefetch", required_argument, 0, 'P' },
+	{ "help", no_argument, 0, 'h' },
+	{ 0, 0, 0, 0 }
+};
+
+static void usage(const char* prog)
+{
+	std::cerr << "Usage: " << prog << " [options] <source> <target> <patch-output>\n"
+		"\n"
+		"Options:\n"
+		"  -a, --adaptive     Keep the target data blocks that have nothing\n"
+		"                     in common with the source compressed\n"
+		"  -d, --drop-cache   Drop the inputs and the expanded files from the page\n"
+		"                     cache while streaming them (for shared hosts)\n"
+		"  -p, --populate     Prefault the whole input images on open\n"
+		"  -P, --prefetch=MIB Read the input blocks in a background thread,\n"
+		"                     up to given distance ahead (for cold storage)\n"
+		"  -H, --huge-pages   Request transparent huge pages for the inputs\n"
+		"  -j, --jobs=N       Use up to N threads for compressor detection\n"
+		"                     (default: the number of CPUs)\n"
+		"  -l, --list-files   Print the paths of the files that have blocks\n"
+		"                     not found in the other image\n"
+		"  -w, --mmap-window=MIB\n"
+		"                     Map the inputs in sliding windows of given size\n"
+		"                     instead of whole (for small address spaces)\n"
+		"  -n, --no-verify    Do not check whether the expanded blocks\n"
+		"                     re-compress identically\n"
+		"  -r, --reassemble   Order the expanded data by file, splitting\n"
+		"                     the fragment blocks into the file tails\n"
+		"  -s, --sort-by-path Like --reassemble, but order the files by path\n"
+		"                     (for images built in a different order)\n"
+		"  -f, --per-file     Like --sort-by-path, but diff the data of every\n"
+		"                     changed file separately (in parallel)\n"
+		"  -N, --normalize    Expand the inode and directory tables in\n"
+		"                     a position-independent form\n"
+		"  -x, --exec-filters Convert the branches in the code of the ELF\n"
+		"                     executables and libraries to absolute form\n"
+		"  -z, --nested       Like --per-file, but also expand the gzip and xz\n"
+		"                     files that re-compress identically\n"
+		"  -h, --help         Print this help\n";
+}
+
 int main(int argc, char* argv[])
 {
-	if (argc < 4)
+	bool drop_cache = false;
+	bool verify = true;
+	bool normalize = false;
+	bool reassemble = false;
+	bool list_changed = false;
+	bool sort_by_path = false;
+	bool per_file = false;
+	bool adaptive = false;
+	bool exec_filters = false;
+	bool expand_nested = false;
+	unsigned int mmap_flags = 0;
+	size_t mmap_window = 0;
+	size_t prefetch_distance = 0;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "adfHj:lnNprsP:w:xzh", long_opts, 0)) != -1)
+	{
+		switch (opt)
+		{
+			case 'a':
+				adaptive = true;
+				break;
+			case 'd':
+				drop_cache = true;
+				break;
+			case 'H':
+				mmap_flags |= MMAPFile::huge_pages;
+				break;
+			case 'j':
+			{
+				char* endp;
+				unsigned long val = strtoul(optarg, &endp, 10);
+
+				if (!*optarg || *endp || val == 0)
+				{
+					std::cerr << "Invalid job count: " << optarg << "\n";
+					return 1;
+				}
+				set_thread_count(val);
+				break;
+			}
+			case 'l':
+				list_changed = true;
+				break;
+			case 'n':
+				verify = false;
+				break;
+			case 'N':
+				normalize = true;
+				break;
+			case 'p':
+				mmap_flags |= MMAPFile::populate;
+				break;
+			case 'r':
+				reassemble = true;
+				break;
+			case 'z':
+				expand_nested = true;
+				// fall through
+			case 'f':
+				per_file = true;
+				// fall through
+			case 's':
+				reassemble = true;
+				sort_by_path = true;
+				break;
+			case 'x':
+				exec_filters = true;
+				break;
+			case 'P':
+			case 'w':
+			{
+				char* endp;
+				unsigned long val = strtoul(optarg, &endp, 10);
+
+				if (!*optarg || *endp || val == 0)
+				{
+					std::cerr << "Invalid size: " << optarg << "\n";
+					return 1;
+				}
+				if (opt == 'P')
+					prefetch_distance = val * 1024 * 1024;
+				else
+					mmap_window = val * 1024 * 1024;
+				break;
+			}
+			case 'h':
+				usage(argv[0]);
+				return 0;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (argc - optind < 3)
 	{
-		std::cerr << "Usage: " << argv[0] << " <source> <target> <patch-output>\n";
+		usage(argv[0]);
 		return 1;
 	}
 
-	const char* source_file = argv[1];
-	const char* target_file = argv[2];
-	const char* patch_file = argv[3];
+	const char* source_file = argv[optind];
+	const char* target_file = argv[optind + 1];
+	const char* patch_file = argv[optind + 2];
 
 	try
 	{
@@ -388,31 +2395,48 @@ int main(int argc, char* argv[])
 
 		std::list<struct compressed_block> source_blocks;
 		std::list<struct compressed_block> target_blocks;
-
-		Compressor* c = 0;
-		size_t block_size = 0;
+		// (nested mode) the files that may be nested compressed files
+		struct nested_candidates source_candidates, target_candidates;
+
+		Compressor* source_c = 0;
+		Compressor* target_c = 0;
+		// (the images may use different block sizes)
+		size_t source_block_size, target_block_size;
+		MetadataNormalizer source_norm, target_norm;
+		std::vector<struct file_data> source_files, target_files;
+		DirectoryTable source_dirs, target_dirs;
+		std::vector<struct file_head> source_heads, target_heads;
 
 		try
 		{
-			source_f.open(source_file);
+			source_f.open(source_file, mmap_flags, mmap_window);
 			std::cerr << "Source: " << source_file << "\n";
-			source_blocks = get_blocks(source_f, c, block_size);
+			source_blocks = get_blocks(source_f, source_c, source_block_size,
+					prefetch_distance, normalize ? &source_norm : 0,
+					reassemble ? &source_files : 0,
+					list_changed || sort_by_path ? &source_dirs : 0,
+					exec_filters ? &source_heads : 0);
+			if (sort_by_path)
+				sort_files_by_path(source_files, source_dirs);
+			if (expand_nested)
+				find_nested_files(source_f, *source_c, source_block_size,
+						source_blocks, source_files, source_candidates);
 		}
 		catch (IOError& e)
 		{
 			std::cerr << "Program terminated abnormally:\n\t"
 				<< e.what() << "\n\tat file: " << source_file
 				<< "\n\terrno: " << strerror(e.errno_val) << "\n";
-			if (c)
-				delete c;
+			if (source_c)
+				delete source_c;
 			return 1;
 		}
 		catch (std::exception& e)
 		{
 			std::cerr << "Program terminated abnormally:\n\t"
 				<< e.what() << "\n\tat file: " << source_file << "\n";
-			if (c)
-				delete c;
+			if (source_c)
+				delete source_c;
 			return 1;
 		}
 
@@ -420,35 +2444,56 @@ int main(int argc, char* argv[])
 
 		try
 		{
-			target_f.open(target_file);
+			target_f.open(target_file, mmap_flags, mmap_window);
 			std::cerr << "Target: " << target_file << "\n";
-			target_blocks = get_blocks(target_f, c, block_size);
+			target_blocks = get_blocks(target_f, target_c, target_block_size,
+					prefetch_distance, normalize ? &target_norm : 0,
+					reassemble ? &target_files : 0,
+					list_changed || sort_by_path ? &target_dirs : 0,
+					exec_filters ? &target_heads : 0);
+			if (sort_by_path)
+				sort_files_by_path(target_files, target_dirs);
+			if (expand_nested)
+				find_nested_files(target_f, *target_c, target_block_size,
+						target_blocks, target_files, target_candidates);
 		}
 		catch (IOError& e)
 		{
 			std::cerr << "Program terminated abnormally:\n\t"
 				<< e.what() << "\n\tat file: " << source_file
 				<< "\n\terrno: " << strerror(e.errno_val) << "\n";
-			delete c;
+			delete source_c;
+			if (target_c)
+				delete target_c;
 			return 1;
 		}
 		catch (std::exception& e)
 		{
 			std::cerr << "Program terminated abnormally:\n\t"
 				<< e.what() << "\n\tat file: " << source_file << "\n";
-			delete c;
+			delete source_c;
+			if (target_c)
+				delete target_c;
 			return 1;
 		}
 
 		std::cerr << "\n";
 
+		// compressed blocks can be matched only if they use
+		// the same compressor
+		bool same_compressor = typeid(*source_c) == typeid(*target_c);
+		if (!same_compressor)
+			std::cerr << "Source and target use different compressors,"
+				" all blocks will be expanded.\n";
+
 		source_blocks.sort(sort_by_len_hash);
 		target_blocks.sort(sort_by_len_hash);
 
 		for (std::list<struct compressed_block>::iterator
 				i = source_blocks.begin(),
 				j = target_blocks.begin();
-				i != source_blocks.end() && j != target_blocks.end();)
+				same_compressor
+				&& i != source_blocks.end() && j != target_blocks.end();)
 		{
 			// seek until we find duplicates
 			if ((*i).length < (*j).length)
@@ -482,13 +2527,39 @@ int main(int argc, char* argv[])
 
 		std::cerr << "Unique blocks found: "
 			<< source_blocks.size() << " in source and "
-			<< target_blocks.size() << " in target.\n";
+			<< target_blocks.size() << " in target (in "
+			<< count_files(source_blocks) << " and "
+			<< count_files(target_blocks) << " files).\n";
+
+		// (only the changed nested files are expanded)
+		if (expand_nested)
+		{
+			try
+			{
+				list_nested_files(source_blocks, source_files,
+						source_candidates, target_candidates);
+				list_nested_files(target_blocks, target_files,
+						target_candidates, source_candidates);
+			}
+			catch (std::exception& e)
+			{
+				std::cerr << "Program terminated abnormally:\n\t"
+					<< e.what() << "\n\twhile listing the nested files\n";
+				return 1;
+			}
+		}
 
 		// now we need to write the expanded files
 
 		source_blocks.sort(sort_by_offset);
 		target_blocks.sort(sort_by_offset);
 
+		if (list_changed)
+		{
+			list_files(source_blocks, source_dirs, "Source");
+			list_files(target_blocks, target_dirs, "Target");
+		}
+
 		// open output before changing cwd
 		SparseFileWriter patch_out;
 		patch_out.open(patch_file);
@@ -505,24 +2576,63 @@ int main(int argc, char* argv[])
 		{
 			std::cerr << "Unable to chdir() into temporary directory\n"
 				"\tDirectory: " << tmpdir << "\n";
-			delete c;
+			delete source_c;
+			delete target_c;
 			return 1;
 		}
 
 		struct sqdelta_header dh;
-		dh.flags = htonl(0);
+		// (the target_compression flag is set once the compression
+		// values are known)
+		dh.flags = htonl((normalize ? sqdelta_flags::normalized : 0)
+				| (reassemble ? sqdelta_flags::reassembled : 0)
+				| (per_file ? sqdelta_flags::per_file : 0)
+				| (exec_filters ? sqdelta_flags::filtered : 0)
+				| (expand_nested ? sqdelta_flags::nested : 0));
 		dh.magic = htonl(sqdelta_magic);
-		dh.compression = htonl(c->get_compression_value());
+		// (compression value is set after expanding each file,
+		// in case the compressor refines its parameters while decompressing)
 
 		TemporarySparseFileWriter source_temp, target_temp;
+		// (per-file mode) the data of the files goes separately
+		TemporarySparseFileWriter source_stream, target_stream;
+		std::vector<struct file_extent> source_extents, target_extents;
+		// (nested mode) the streams with the nested files expanded
+		TemporarySparseFileWriter source_nested_stream, target_nested_stream;
+		std::vector<struct nested_file> source_nested, target_nested;
+		// (adaptive mode) the samples of the expanded source data
+		FingerprintIndex fingerprints;
+		// the filters for the code of the files to expand
+		std::unordered_map<uint32_t, filter::type>
+			source_filters, target_filters;
 		try
 		{
 			std::cerr << "Writing expanded source file..." << std::endl;
 
-			c->reset();
-			source_temp.open(source_f.getlen());
-			write_unpacked_file(source_temp, source_f, source_blocks, *c,
-					block_size);
+			source_temp.open();
+			if (drop_cache)
+				source_temp.drop_cache(drop_cache_window);
+			if (per_file)
+				source_stream.open();
+			if (exec_filters)
+				source_filters = detect_executables(source_f, *source_c,
+						source_block_size, source_blocks, source_heads);
+			write_unpacked_file(source_temp, source_f, source_blocks,
+					*source_c, source_block_size, drop_cache,
+					prefetch_distance, verify,
+					normalize ? &source_norm : 0,
+					reassemble ? &source_files : 0,
+					per_file ? &source_stream : 0, &source_extents,
+					adaptive ? &fingerprints : 0, false,
+					exec_filters ? &source_filters : 0);
+			if (expand_nested)
+			{
+				source_nested_stream.open();
+				expand_nested_files(source_stream.fd, source_extents,
+						source_nested_stream, source_nested);
+				source_stream.close();
+			}
+			dh.compression = htonl(source_c->get_compression_value());
 			write_block_list(source_temp, dh, source_blocks);
 		}
 		catch (IOError& e)
@@ -530,14 +2640,16 @@ int main(int argc, char* argv[])
 			std::cerr << "Program terminated abnormally:\n\t"
 				<< e.what() << "\n\tat temporary file for source"
 				<< "\n\terrno: " << strerror(e.errno_val) << "\n";
-			delete c;
+			delete source_c;
+			delete target_c;
 			return 1;
 		}
 		catch (std::exception& e)
 		{
 			std::cerr << "Program terminated abnormally:\n\t"
 				<< e.what() << "\n\tat temporary file for source\n";
-			delete c;
+			delete source_c;
+			delete target_c;
 			return 1;
 		}
 
@@ -545,31 +2657,118 @@ int main(int argc, char* argv[])
 		{
 			std::cerr << "Writing expanded target file..." << std::endl;
 
-			c->reset();
-			target_temp.open(target_f.getlen());
-			write_unpacked_file(target_temp, target_f, target_blocks, *c,
-					block_size);
-			write_block_list(target_temp, dh, target_blocks);
+			target_temp.open();
+			if (drop_cache)
+				target_temp.drop_cache(drop_cache_window);
+			if (per_file)
+				target_stream.open();
+			if (exec_filters)
+				target_filters = detect_executables(target_f, *target_c,
+						target_block_size, target_blocks, target_heads);
+			write_unpacked_file(target_temp, target_f, target_blocks,
+					*target_c, target_block_size, drop_cache,
+					prefetch_distance, verify,
+					normalize ? &target_norm : 0,
+					reassemble ? &target_files : 0,
+					per_file ? &target_stream : 0, &target_extents,
+					adaptive ? &fingerprints : 0, true,
+					exec_filters ? &target_filters : 0);
+			if (expand_nested)
+			{
+				target_nested_stream.open();
+				expand_nested_files(target_stream.fd, target_extents,
+						target_nested_stream, target_nested);
+				target_stream.close();
+			}
+
+			// the expanded target carries its own compression value
+			struct sqdelta_header th = dh;
+			th.flags = htonl(ntohl(dh.flags)
+					& ~sqdelta_flags::target_compression);
+			th.compression = htonl(target_c->get_compression_value());
+			write_block_list(target_temp, th, target_blocks);
 		}
 		catch (IOError& e)
 		{
 			std::cerr << "Program terminated abnormally:\n\t"
 				<< e.what() << "\n\tat temporary file for target"
 				<< "\n\terrno: " << strerror(e.errno_val) << "\n";
-			delete c;
+			delete source_c;
+			delete target_c;
 			return 1;
 		}
 		catch (std::exception& e)
 		{
 			std::cerr << "Program terminated abnormally:\n\t"
 				<< e.what() << "\n\tat temporary file for target\n";
-			delete c;
+			delete source_c;
+			delete target_c;
 			return 1;
 		}
 
-		delete c;
+		// the same compressor may still use different parameters
+		uint32_t target_compression = target_c->get_compression_value();
+		if (target_compression != source_c->get_compression_value())
+			dh.flags = htonl(ntohl(dh.flags)
+					| sqdelta_flags::target_compression);
+
+		delete source_c;
+		delete target_c;
+
+		std::cerr << "Expanded files written (" << major_faults()
+			<< " major page faults in total)." << std::endl;
+
+		write_block_list(patch_out, dh, source_blocks, false,
+				target_compression);
+
+		if (expand_nested)
+		{
+			write_nested_list(patch_out, source_nested);
+			write_nested_list(patch_out, target_nested);
+		}
+
+		if (per_file)
+		{
+			TemporarySparseFileWriter& source_data
+				= expand_nested ? source_nested_stream : source_stream;
+			TemporarySparseFileWriter& target_data
+				= expand_nested ? target_nested_stream : target_stream;
+			std::vector<long> pairs;
+
+			try
+			{
+				pairs = pair_files(source_data.fd, source_extents,
+						target_data.fd, target_extents,
+						source_dirs, target_dirs);
+			}
+			catch (std::exception& e)
+			{
+				std::cerr << "Program terminated abnormally:\n\t"
+					<< e.what() << "\n\twhile pairing the files\n";
+				return 1;
+			}
+
+			std::cerr << "Calling xdelta to diff " << target_extents.size()
+				<< " changed files (" << std::count_if(pairs.begin(),
+						pairs.end(), [](long p) { return p != -1; })
+				<< " found in source)..." << std::endl;
+
+			try
+			{
+				write_file_deltas(patch_out,
+						source_data.fd, source_extents,
+						target_data.fd, target_extents, pairs);
+			}
+			catch (std::exception& e)
+			{
+				std::cerr << "Program terminated abnormally:\n\t"
+					<< e.what() << "\n\twhile diffing the files\n";
+				return 1;
+			}
 
-		write_block_list(patch_out, dh, source_blocks, false);
+			source_data.close();
+			target_data.close();
+		}
 
 		std::cerr << "Calling xdelta to generate the diff..." << std::endl;
 
@@ -596,7 +2795,9 @@ int main(int argc, char* argv[])
 			{
 				std::cerr << "Error occured in child process:\n\t"
 					<< e.what() << "\n\terrno: " << strerror(e.errno_val) << "\n";
-				return 1;
+				// (the destructors would join the parent's worker
+				// threads and remove its temporary files)
+				_exit(1);
 			}
 		}
 		else
@@ -8,6 +8,7 @@
 #	include "config.h"
 #endif
 
+#include <algorithm>
 #include <cstring>
 
 extern "C"
@@ -101,35 +102,117 @@ size_t squashfs::inode::lreg::inode_size(uint32_t block_size,
 	return sizeof(*this) + blocks * sizeof(le32);
 }
 
+const size_t MetadataBlockReader::max_batch;
+
 MetadataBlockReader::MetadataBlockReader(const MMAPFile& new_file,
-		size_t offset, Compressor& c)
-	: f(new_file), compressor(c)
+		size_t offset, Compressor& c, size_t new_end)
+	: f(new_file), compressor(c), end(new_end)
 {
 	f.seek(offset, std::ios::beg);
 }
 
-size_t MetadataBlockReader::read(void* dest, size_t dest_size)
+size_t MetadataBlockReader::read(void* dest, size_t dest_size,
+		size_t* block_count)
 {
-	bool compressed;
-	size_t length;
-	const void* data;
+	size_t max_blocks = std::min(dest_size / squashfs::metadata_size,
+			max_batch);
+	if (!end || max_blocks == 0)
+		max_blocks = 1;
+
+	// find the extents of the following blocks first,
+	// so that they can be read from a single mapping
+	size_t start = f.getpos();
+	size_t pos = start;
+	uint16_t headers[max_batch];
+	size_t n = 0;
+
+	do
+	{
+		headers[n] = f.read<le16>();
+		pos += sizeof(le16)
+			+ (headers[n] & ~squashfs::inode_size::uncompressed);
+		f.seek(pos, std::ios::beg);
+		++n;
+	}
+	while (n < max_blocks && pos + sizeof(le16) <= end);
+
+	f.seek(start, std::ios::beg);
+	const char* data = f.read_array<char>(pos - start);
 
-	read_input_block(&data, nullptr, &length, &compressed);
+	struct decompress_slot slots[max_batch];
+	size_t slot_count = 0;
+	char* destp = static_cast<char*>(dest);
 
-	if (!compressed)
+	// every block goes into its own metadata_size slot first
+	for (size_t i = 0; i < n; ++i)
 	{
-		// uncompressed block
-		if (length > dest_size)
-			throw std::logic_error("Output buffer too small for the metadata");
+		size_t length = headers[i] & ~squashfs::inode_size::uncompressed;
+		size_t out_size = std::min<size_t>(squashfs::metadata_size,
+				dest_size - i * squashfs::metadata_size);
+		const char* src = data + sizeof(le16);
 
-		memcpy(dest, data, length);
-		return length;
+		if (headers[i] & squashfs::inode_size::uncompressed)
+		{
+			if (length > out_size)
+				throw std::logic_error("Output buffer too small for the metadata");
+
+			memcpy(destp + i * squashfs::metadata_size, src, length);
+		}
+		else
+		{
+			struct decompress_slot& s = slots[slot_count++];
+
+			s.src = src;
+			s.length = length;
+			s.dest = destp + i * squashfs::metadata_size;
+			s.out_size = out_size;
+		}
+
+		// store the output length in place of the header
+		headers[i] = length;
+		data = src + length;
 	}
-	else
+
+	compressor.decompress_batch(slots, slot_count);
+
+	// then, the output is moved together
+	size_t out_pos = 0;
+	for (size_t i = 0, j = 0; i < n; ++i)
 	{
-		// uncompress to buf
-		return compressor.decompress(dest, data, length, dest_size);
+		char* blockp = destp + i * squashfs::metadata_size;
+		size_t length = headers[i];
+
+		if (j < slot_count && slots[j].dest == blockp)
+			length = slots[j++].out_bytes;
+
+		if (out_pos != i * squashfs::metadata_size)
+			memmove(destp + out_pos, blockp, length);
+		out_pos += length;
 	}
+
+	if (block_count)
+		*block_count = n;
+	return out_pos;
+}
+
+size_t MetadataBlockReader::count_blocks() const
+{
+	if (!end)
+		throw std::logic_error("Counting blocks in a table of unknown size");
+
+	MMAPFile hf = f;
+	size_t pos = hf.getpos();
+	size_t n = 0;
+
+	while (pos + sizeof(le16) <= end)
+	{
+		hf.seek(pos, std::ios::beg);
+		pos += sizeof(le16)
+			+ (hf.read<le16>() & ~squashfs::inode_size::uncompressed);
+		++n;
+	}
+
+	return n;
 }
 
 void MetadataBlockReader::read_input_block(const void** data,
@@ -145,10 +228,31 @@ void MetadataBlockReader::read_input_block(const void** data,
 }
 
 MetadataReader::MetadataReader(const MMAPFile& new_file,
-		size_t offset, Compressor& c)
-	: f(new_file, offset, c),
-	bufp(buf), buf_filled(0), _block_num(0)
+		size_t offset, Compressor& c, size_t end)
+	: f(new_file, offset, c, end),
+	bufp(buf), buf_filled(0), _block_num(0), whole_table(end != 0)
 {
+	if (whole_table)
+		read_table();
+}
+
+void MetadataReader::read_table()
+{
+	size_t block_count = f.count_blocks();
+
+	// every block but the last one is metadata_size long
+	arena.resize(block_count * squashfs::metadata_size);
+
+	while (_block_num < block_count)
+	{
+		size_t n;
+
+		buf_filled += f.read(&arena[buf_filled],
+				arena.size() - buf_filled, &n);
+		_block_num += n;
+	}
+
+	bufp = arena.empty() ? 0 : &arena.front();
 }
 
 void MetadataReader::poll_data()
@@ -165,17 +269,27 @@ void MetadataReader::poll_data()
 		writep = bufp + buf_filled;
 	}
 
-	// passing size of metadata_size since we don't expect a bigger
-	// output and we can guarantee that we have at least that much free
-	buf_filled += f.read(writep, squashfs::metadata_size);
+	// after the shift, at least half of the buffer is free,
+	// so we can read a few blocks at once
+	size_t block_count;
+	buf_filled += f.read(writep, buf + buf_size - writep, &block_count);
 
-	++_block_num;
+	_block_num += block_count;
 }
 
 void* MetadataReader::peek(size_t length)
 {
-	while (buf_filled < length)
-		poll_data();
+	if (whole_table)
+	{
+		// there is nothing more to read
+		if (buf_filled < length)
+			throw std::runtime_error("Trying to read past the end of the metadata table");
+	}
+	else
+	{
+		while (buf_filled < length)
+			poll_data();
+	}
 
 	return static_cast<void*>(bufp);
 }
@@ -186,6 +300,15 @@ void MetadataReader::seek(size_t length)
 	buf_filled -= length;
 }
 
+const char* MetadataReader::peek_all(size_t* length)
+{
+	if (!whole_table)
+		throw std::logic_error("peek_all() on a streaming metadata reader");
+
+	*length = buf_filled;
+	return bufp;
+}
+
 size_t MetadataReader::block_num()
 {
 	if (buf_filled > 0)
@@ -197,7 +320,7 @@ size_t MetadataReader::block_num()
 InodeReader::InodeReader(const MMAPFile& new_file,
 		const struct squashfs::super_block& sb,
 		Compressor& c)
-	: f(new_file, sb.inode_table_start, c),
+	: f(new_file, sb.inode_table_start, c, sb.directory_table_start),
 	inode_num(0), no_inodes(sb.inodes),
 	block_size(sb.block_size), block_log(sb.block_log)
 {
@@ -332,6 +455,183 @@ size_t InodeReader::block_num()
 	return f.block_num();
 }
 
+InodeScanner::InodeScanner(const MMAPFile& new_file,
+		const struct squashfs::super_block& sb,
+		Compressor& c)
+	: f(new_file, sb.inode_table_start, c, sb.directory_table_start),
+	inode_num(0), no_inodes(sb.inodes),
+	block_size(sb.block_size), block_log(sb.block_log)
+{
+	size_t length;
+
+	start = p = f.peek_all(&length);
+	end = p + length;
+}
+
+uint16_t InodeScanner::peek_type()
+{
+	if (end - p < static_cast<ptrdiff_t>(sizeof(squashfs::inode::base)))
+		throw std::runtime_error("Trying to read past the end of the inode table");
+
+	uint16_t type = reinterpret_cast<const squashfs::inode::base*>(p)
+		->inode_type;
+	if (!type || type > squashfs::inode::type::lsocket)
+		throw std::runtime_error("Invalid inode type");
+
+	if (end - p < static_cast<ptrdiff_t>(squashfs::inode::fixed_size[type]))
+		throw std::runtime_error("Trying to read past the end of the inode table");
+
+	return type;
+}
+
+// size of an inode other than a regular file
+size_t InodeScanner::other_inode_size(uint16_t type)
+{
+	size_t inode_len = squashfs::inode::fixed_size[type];
+
+	switch (type)
+	{
+		case squashfs::inode::type::symlink:
+		case squashfs::inode::type::lsymlink:
+			inode_len += reinterpret_cast<const squashfs::inode::symlink*>(p)
+				->symlink_size;
+			break;
+		case squashfs::inode::type::ldir:
+		{
+			uint16_t i_count
+				= reinterpret_cast<const squashfs::inode::ldir*>(p)->i_count;
+
+			// the indexes have variable length names
+			for (uint16_t i = 0; i < i_count; ++i)
+			{
+				if (end - p < static_cast<ptrdiff_t>(inode_len
+							+ sizeof(struct squashfs::dir_index)))
+					throw std::runtime_error("Trying to read past the end of the inode table");
+
+				const struct squashfs::dir_index* idx
+					= reinterpret_cast<const squashfs::dir_index*>(
+							p + inode_len);
+
+				// size is length-1
+				inode_len += sizeof(struct squashfs::dir_index)
+					+ idx->size + 1;
+			}
+			break;
+		}
+	}
+
+	if (end - p < static_cast<ptrdiff_t>(inode_len))
+		throw std::runtime_error("Trying to read past the end of the inode table");
+	return inode_len;
+}
+
+bool InodeScanner::next_file(struct file& out)
+{
+	while (inode_num < no_inodes)
+	{
+		uint16_t type = peek_type();
+		++inode_num;
+
+		if (type == squashfs::inode::type::reg)
+		{
+			const struct squashfs::inode::reg* in
+				= reinterpret_cast<const squashfs::inode::reg*>(p);
+
+			out.start_block = in->start_block;
+			out.file_size = in->file_size;
+			out.inode_number = in->inode_number;
+			out.fragment = in->fragment;
+			out.fragment_offset = in->offset;
+		}
+		else if (type == squashfs::inode::type::lreg)
+		{
+			const struct squashfs::inode::lreg* in
+				= reinterpret_cast<const squashfs::inode::lreg*>(p);
+
+			out.start_block = in->start_block;
+			out.file_size = in->file_size;
+			out.inode_number = in->inode_number;
+			out.fragment = in->fragment;
+			out.fragment_offset = in->offset;
+		}
+		else
+		{
+			p += other_inode_size(type);
+			continue;
+		}
+
+		// regular file, the block list follows
+		uint64_t blocks = out.file_size;
+		// if fragments were not used, round up the last block
+		if (out.fragment == squashfs::invalid_frag)
+			blocks += block_size - 1;
+		out.block_count = blocks >> block_log;
+
+		size_t inode_len = squashfs::inode::fixed_size[type]
+			+ out.block_count * sizeof(le32);
+		if (end - p < static_cast<ptrdiff_t>(inode_len))
+			throw std::runtime_error("Trying to read past the end of the inode table");
+
+		out.block_list = reinterpret_cast<const le32*>(
+				p + squashfs::inode::fixed_size[type]);
+		p += inode_len;
+		return true;
+	}
+
+	return false;
+}
+
+bool InodeScanner::next_inode(struct inode_entry& out)
+{
+	if (inode_num >= no_inodes)
+		return false;
+
+	const char* prev = p;
+	uint16_t type = peek_type();
+
+	out.type = type;
+	out.inode_number = reinterpret_cast<const squashfs::inode::base*>(p)
+		->inode_number;
+	out.offset = p - start;
+
+	if (type == squashfs::inode::type::reg
+			|| type == squashfs::inode::type::lreg)
+	{
+		struct file dummy;
+
+		next_file(dummy);
+	}
+	else
+	{
+		p += other_inode_size(type);
+		++inode_num;
+	}
+
+	out.length = p - prev;
+	return true;
+}
+
+void InodeScanner::rewind()
+{
+	p = start;
+	inode_num = 0;
+}
+
+const char* InodeScanner::table(size_t* length) const
+{
+	*length = end - start;
+	return start;
+}
+
+size_t InodeScanner::block_num()
+{
+	size_t length;
+
+	// mark the whole walked data as read
+	f.seek(p - f.peek_all(&length));
+	return f.block_num();
+}
+
 static uint64_t get_fragment_table_offset(const MMAPFile& new_file,
 		const struct squashfs::super_block& sb)
 {
@@ -349,7 +649,8 @@ static uint64_t get_fragment_table_offset(const MMAPFile& new_file,
 FragmentTableReader::FragmentTableReader(const MMAPFile& new_file,
 		const struct squashfs::super_block& sb,
 		Compressor& c)
-	: f(new_file, get_fragment_table_offset(new_file, sb), c),
+	: f(new_file, get_fragment_table_offset(new_file, sb), c,
+			sb.fragments ? sb.fragment_table_start : 0),
 	entry_num(0), no_entries(sb.fragments),
 	start_offset(get_fragment_table_offset(new_file, sb))
 {
@@ -372,3 +673,160 @@ size_t FragmentTableReader::block_num()
 {
 	return f.block_num();
 }
+
+void DirectoryTable::load(const MMAPFile& f,
+		const squashfs::super_block& sb, Compressor& c,
+		InodeScanner& ir, uint64_t end)
+{
+	std::vector<uint32_t> block_pos = metadata_block_positions(f,
+			sb.directory_table_start, end);
+	std::vector<uint32_t> inode_block_pos = metadata_block_positions(f,
+			sb.inode_table_start, sb.directory_table_start);
+	MetadataReader dr(f, sb.directory_table_start, c, end);
+	size_t length;
+	const char* data = dr.peek_all(&length);
+
+	size_t inode_table_length;
+	const char* inodes = ir.table(&inode_table_length);
+	struct InodeScanner::inode_entry e;
+
+	parents.assign(static_cast<size_t>(sb.inodes) + 1, 0);
+	names.assign(static_cast<size_t>(sb.inodes) + 1, 0);
+	name_pool.clear();
+	root = 0;
+
+	ir.rewind();
+	while (ir.next_inode(e))
+	{
+		size_t inode_block = e.offset / squashfs::metadata_size;
+		if (inode_block < inode_block_pos.size()
+				&& (static_cast<uint64_t>(inode_block_pos[inode_block]) << 16
+					| e.offset % squashfs::metadata_size) == sb.root_inode)
+			root = e.inode_number;
+
+		uint32_t start_block;
+		uint32_t offset;
+		uint32_t listing_size;
+
+		if (e.type == squashfs::inode::type::dir)
+		{
+			const squashfs::inode::dir* in
+				= reinterpret_cast<const squashfs::inode::dir*>(
+						inodes + e.offset);
+
+			start_block = in->start_block;
+			offset = in->offset;
+			listing_size = in->file_size;
+		}
+		else if (e.type == squashfs::inode::type::ldir)
+		{
+			const squashfs::inode::ldir* in
+				= reinterpret_cast<const squashfs::inode::ldir*>(
+						inodes + e.offset);
+
+			start_block = in->start_block;
+			offset = in->offset;
+			listing_size = in->file_size;
+		}
+		else
+			continue;
+
+		// (the size includes the '.' and '..' entries)
+		if (listing_size <= 3)
+			continue;
+
+		std::vector<uint32_t>::iterator block = std::lower_bound(
+				block_pos.begin(), block_pos.end(), start_block);
+		if (block == block_pos.end() || *block != start_block)
+			throw std::runtime_error("Directory listing outside the directory table");
+
+		size_t pos = (block - block_pos.begin()) * squashfs::metadata_size
+			+ offset;
+		size_t listing_end = pos + listing_size - 3;
+		if (listing_end > length)
+			throw std::runtime_error("Directory listing outside the directory table");
+
+		while (pos < listing_end)
+		{
+			if (listing_end - pos < sizeof(struct squashfs::dir_header))
+				throw std::runtime_error("Invalid directory listing");
+
+			const struct squashfs::dir_header* h
+				= reinterpret_cast<const squashfs::dir_header*>(data + pos);
+			uint32_t count = h->count + 1;
+			uint32_t inode_number = h->inode_number;
+			pos += sizeof(struct squashfs::dir_header);
+
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				if (listing_end - pos < sizeof(struct squashfs::dir_entry))
+					throw std::runtime_error("Invalid directory listing");
+
+				const struct squashfs::dir_entry* de
+					= reinterpret_cast<const squashfs::dir_entry*>(data + pos);
+				size_t name_length = de->size + 1;
+				uint32_t entry_number = inode_number
+					+ static_cast<int16_t>(de->inode_number);
+
+				pos += sizeof(struct squashfs::dir_entry);
+				if (listing_end - pos < name_length)
+					throw std::runtime_error("Invalid directory listing");
+
+				if (entry_number != 0 && entry_number < parents.size())
+				{
+					parents[entry_number] = e.inode_number;
+					names[entry_number] = name_pool.size() << 8
+						| (name_length - 1);
+					name_pool.insert(name_pool.end(), data + pos,
+							data + pos + name_length);
+				}
+				pos += name_length;
+			}
+		}
+	}
+}
+
+std::string DirectoryTable::path(uint32_t inode_number) const
+{
+	std::vector<uint32_t> chain;
+
+	// (the depth is limited to protect against loops)
+	while (inode_number != root && inode_number < parents.size()
+			&& parents[inode_number] != 0 && chain.size() < parents.size())
+	{
+		chain.push_back(inode_number);
+		inode_number = parents[inode_number];
+	}
+
+	// (the inodes not listed in any directory do not reach the root)
+	if (root == 0 || inode_number != root)
+		return "";
+	if (chain.empty())
+		return "/";
+
+	std::string ret;
+	for (std::vector<uint32_t>::reverse_iterator i = chain.rbegin();
+			i != chain.rend(); ++i)
+	{
+		ret += '/';
+		ret.append(&name_pool[names[*i] >> 8], (names[*i] & 0xff) + 1);
+	}
+	return ret;
+}
+
+std::vector<uint32_t> metadata_block_positions(const MMAPFile& f,
+		uint64_t start, uint64_t end)
+{
+	std::vector<uint32_t> ret;
+	MMAPFile hf(f);
+	hf.seek(start, std::ios::beg);
+
+	while (hf.getpos() < end)
+	{
+		ret.push_back(hf.getpos() - start);
+		uint16_t header = hf.read<le16>();
+		hf.seek(header & ~squashfs::inode_size::uncompressed);
+	}
+
+	return ret;
+}
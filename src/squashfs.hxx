@@ -26,6 +26,9 @@ extern "C"
 #endif
 }
 
+#include <string>
+#include <vector>
+
 #include "util.hxx"
 
 class Compressor;
@@ -36,6 +39,8 @@ namespace squashfs
 
 	const uint32_t magic = 0x73717368UL;
 	const uint32_t invalid_frag = 0xffffffffUL;
+	// start of a table that is not present
+	const uint64_t invalid_table = 0xffffffffffffffffULL;
 
 	const int metadata_size = 8192;
 
@@ -224,6 +229,25 @@ namespace squashfs
 			struct dir_index* index();
 		};
 
+		// size of the fixed part of each inode type
+		constexpr size_t fixed_size[] = {
+			0,
+			sizeof(struct dir),
+			sizeof(struct reg),
+			sizeof(struct symlink),
+			sizeof(struct dev), // blkdev
+			sizeof(struct dev), // chrdev
+			sizeof(struct ipc), // fifo
+			sizeof(struct ipc), // socket
+			sizeof(struct ldir),
+			sizeof(struct lreg),
+			sizeof(struct symlink) + sizeof(le32), // lsymlink (+xattr)
+			sizeof(struct ldev), // lblkdev
+			sizeof(struct ldev), // lchrdev
+			sizeof(struct lipc), // lfifo
+			sizeof(struct lipc) // lsocket
+		};
+
 		union inode
 		{
 			base as_base;
@@ -239,6 +263,35 @@ namespace squashfs
 		};
 	}
 
+	struct xattr_id_table {
+		le64 xattr_table_start;
+		le32 xattr_ids;
+		le32 unused;
+	};
+
+	// sizes of the entries in the indexed tables
+	namespace entry_size
+	{
+		const size_t id = 4;
+		const size_t lookup = 8;
+		const size_t xattr_id = 16;
+	}
+
+	struct dir_header {
+		le32 count; // (minus one)
+		le32 start_block;
+		le32 inode_number;
+	};
+
+	struct dir_entry {
+		le16 offset;
+		le16 inode_number; // (signed, relative to the header)
+		le16 type;
+		le16 size; // (of the name, minus one)
+
+		//char name[0];
+	};
+
 	struct fragment_entry {
 		le64 start_block;
 		le32 size;
@@ -252,12 +305,21 @@ class MetadataBlockReader
 {
 	MMAPFile f;
 	Compressor& compressor;
+	// end of the metadata table (0 if unknown)
+	size_t end;
 
 public:
+	// max number of blocks decompressed in a single batch
+	static const size_t max_batch = 8;
+
 	MetadataBlockReader(const MMAPFile& new_file,
-			size_t offset, Compressor& c);
+			size_t offset, Compressor& c, size_t end = 0);
 
-	size_t read(void* dest, size_t dest_size);
+	// read as many blocks as fit into dest (one if the end of the table
+	// is unknown), returns the total length
+	size_t read(void* dest, size_t dest_size, size_t* block_count = 0);
+	// count the blocks remaining until the end of the table
+	size_t count_blocks() const;
 
 	void read_input_block(const void** data, size_t* pos,
 			size_t* length, bool* compressed);
@@ -273,17 +335,25 @@ class MetadataReader
 	size_t buf_filled;
 	size_t _block_num;
 
+	// if the end of the table is known, the whole table is
+	// decompressed into the arena instead of buf
+	bool whole_table;
+	std::vector<char> arena;
+
 	void poll_data();
+	void read_table();
 
 public:
 	MetadataReader(const MMAPFile& new_file,
-			size_t offset, Compressor& c);
+			size_t offset, Compressor& c, size_t end = 0);
 
 	template <class T>
 	const T& read();
 
 	void* peek(size_t length);
 	void seek(size_t length);
+	// get all the data left in a whole-table reader
+	const char* peek_all(size_t* length);
 
 	size_t block_num();
 };
@@ -316,6 +386,64 @@ public:
 	size_t block_num();
 };
 
+// scans the inode table for the block lists of regular files,
+// skipping over the other inodes
+class InodeScanner
+{
+	MetadataReader f;
+	// the whole table is walked in place
+	const char* start;
+	const char* p;
+	const char* end;
+
+	uint32_t inode_num;
+	uint32_t no_inodes;
+	uint32_t block_size;
+	uint16_t block_log;
+
+	uint16_t peek_type();
+	size_t other_inode_size(uint16_t type);
+
+public:
+	struct file
+	{
+		uint64_t start_block;
+		uint64_t file_size;
+		uint32_t inode_number;
+		uint32_t fragment;
+		// offset of the tail in the fragment
+		uint32_t fragment_offset;
+		uint32_t block_count;
+		const le32* block_list;
+	};
+
+	struct inode_entry
+	{
+		uint16_t type;
+		uint32_t inode_number;
+		// position in the (uncompressed) table
+		size_t offset;
+		size_t length;
+	};
+
+	InodeScanner(const MMAPFile& new_file,
+		const struct squashfs::super_block& sb,
+		Compressor& c);
+
+	// find the next regular file, returns false after the last inode
+	// (the block list stays valid as long as the scanner)
+	bool next_file(struct file& out);
+	// get the next inode of any type
+	bool next_inode(struct inode_entry& out);
+
+	// start again from the first inode
+	void rewind();
+	// the whole (uncompressed) table
+	const char* table(size_t* length) const;
+
+	size_t block_num();
+};
+
 class FragmentTableReader
 {
 	MetadataReader f;
@@ -335,4 +463,29 @@ public:
 	size_t block_num();
 };
 
+// The names and parents of all the inodes, read from the listings
+// of the directories found in the inode table.
+class DirectoryTable
+{
+	// inode number -> parent inode number (0 if none)
+	std::vector<uint32_t> parents;
+	// inode number of the root directory
+	uint32_t root;
+	// inode number -> position of the name in the pool << 8 | (length - 1)
+	std::vector<uint64_t> names;
+	std::vector<char> name_pool;
+
+public:
+	void load(const MMAPFile& f, const squashfs::super_block& sb,
+			Compressor& c, InodeScanner& ir, uint64_t end);
+
+	// get the full path of the inode (empty if it is not in the tree)
+	std::string path(uint32_t inode_number) const;
+};
+
+// positions of the metadata blocks between start and end,
+// relative to start (as used in the references)
+std::vector<uint32_t> metadata_block_positions(const MMAPFile& f,
+		uint64_t start, uint64_t end);
+
 #endif /*!SDT_SQUASHFS_HXX*/
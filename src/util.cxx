@@ -8,7 +8,13 @@
 #	include "config.h"
 #endif
 
+#include <algorithm>
+#include <exception>
+#include <list>
+#include <mutex>
+
 #include <cerrno>
+#include <cstdint>
 #include <cstring>
 
 extern "C"
@@ -28,87 +34,324 @@ IOError::IOError(const char* text, int new_errno)
 {
 }
 
-MMAPFile::MMAPFile()
-	: fd(-1), pos(0), length(0), data(0)
+struct MMAPFile::Mapping
+{
+	struct window
+	{
+		size_t offset;
+		size_t length;
+		char* data;
+	};
+
+	int fd;
+	size_t length;
+	// whole-file mapping, if used
+	void* data;
+
+	// windowed mode
+	size_t window_size;
+	int mmap_flags;
+	// most recently used first
+	std::list<window> windows;
+
+	Mapping();
+	~Mapping();
+};
+
+MMAPFile::Mapping::Mapping()
+	: fd(-1), length(0), data(0), window_size(0), mmap_flags(0)
 {
 }
 
-
-MMAPFile::MMAPFile(const MMAPFile& ref)
-	// just copy the data necessary for read/seek
-	// but not the one needed to close/unmap
-	: fd(-1), pos(ref.pos), end(ref.end), length(0), data(ref.data)
+MMAPFile::Mapping::~Mapping()
 {
+	// there's no sane way of reporting errors here,
+	// and the file was opened read-only anyway
+	if (data)
+		munmap(data, length);
+	for (std::list<window>::iterator i = windows.begin();
+			i != windows.end(); ++i)
+		munmap((*i).data, (*i).length);
+	if (fd != -1)
+		::close(fd);
 }
 
-MMAPFile::~MMAPFile()
+MMAPFile::MMAPFile()
+	: data(0), length(0), pos(0)
 {
-	close();
 }
 
-void MMAPFile::open(const char* path)
+void MMAPFile::open(const char* path, unsigned int flags,
+		size_t window_size)
 {
-	fd = ::open(path, O_RDONLY);
-	if (fd == -1)
+	std::shared_ptr<Mapping> m(new Mapping());
+
+	m->fd = ::open(path, O_RDONLY);
+	if (m->fd == -1)
 		throw IOError("Unable to open file", errno);
 
 	// this also checks whether the file is seekable
-	off_t size = lseek(fd, 0, SEEK_END);
+	off_t size = lseek(m->fd, 0, SEEK_END);
 	if (size == -1)
-	{
-		close();
 		throw IOError("Unable to seek file (not a regular file?)", errno);
-	}
+
+	if (static_cast<uint64_t>(size) > SIZE_MAX)
+		throw std::runtime_error("File too large for the address space");
 
 	// size_t <- off_t
-	length = size;
+	m->length = size;
 
-	data = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
-	if (data == MAP_FAILED)
+	m->mmap_flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+	if (flags & populate)
+		m->mmap_flags |= MAP_POPULATE;
+#endif
+
+	if (window_size == 0)
 	{
-		close();
-		throw IOError("Unable to mmap() file", errno);
+		m->data = mmap(0, m->length, PROT_READ, m->mmap_flags, m->fd, 0);
+		if (m->data == MAP_FAILED)
+		{
+			m->data = 0;
+
+			// not enough address space, so fall back to windows
+			if (errno != ENOMEM)
+				throw IOError("Unable to mmap() file", errno);
+			window_size = default_window_size;
+		}
+#ifdef MADV_HUGEPAGE
+		// file-backed THP needs kernel support, so failure is fine
+		else if (flags & huge_pages)
+			madvise(m->data, m->length, MADV_HUGEPAGE);
+#endif
 	}
 
-	pos = static_cast<char*>(data);
-	end = pos + length;
+	if (window_size != 0)
+	{
+		// windows need to start at page boundaries
+		size_t page_size = sysconf(_SC_PAGESIZE);
+		m->window_size = (window_size + page_size - 1) & ~(page_size - 1);
+	}
+
+	mapping = m;
+	data = static_cast<char*>(m->data);
+	length = m->length;
+	pos = 0;
 }
 
-void MMAPFile::close()
+const char* MMAPFile::map_window(size_t offset, size_t n)
 {
-	bool munmap_failed = false;
-	bool close_failed = false;
+	Mapping& m = *mapping;
 
-	if (data && length > 0)
+	for (std::list<Mapping::window>::iterator i = m.windows.begin();
+			i != m.windows.end(); ++i)
 	{
-		if (::munmap(data, length) == -1)
-			munmap_failed = true;
-		data = 0;
-		length = 0;
-		pos = 0;
+		if (offset >= (*i).offset
+				&& offset + n <= (*i).offset + (*i).length)
+		{
+			// move it to the front of LRU
+			if (i != m.windows.begin())
+				m.windows.splice(m.windows.begin(), m.windows, i);
+			return (*i).data + (offset - (*i).offset);
+		}
 	}
 
-	if (fd != -1)
+	// start at window boundary to make the windows reusable
+	// for nearby reads, and extend the window if the read is larger
+	struct Mapping::window w;
+	w.offset = offset - offset % m.window_size;
+	w.length = m.window_size;
+	if (offset + n - w.offset > w.length)
 	{
-		if (::close(fd) == -1)
-			close_failed = true;
-		fd = -1;
+		size_t page_size = sysconf(_SC_PAGESIZE);
+		w.length = (offset + n - w.offset + page_size - 1)
+			& ~(page_size - 1);
 	}
+	if (w.length > m.length - w.offset)
+		w.length = m.length - w.offset;
 
-	if (munmap_failed && close_failed)
-		throw IOError("Unable to unmap and close file", errno);
-	else if (munmap_failed)
-		throw IOError("Unable to unmap file (yet it was closed)", errno);
-	else if (close_failed)
-		throw IOError("Unable to close file", errno);
+	if (m.windows.size() >= window_count)
+	{
+		Mapping::window& old = m.windows.back();
+		if (munmap(old.data, old.length) == -1)
+			throw IOError("Unable to unmap file window", errno);
+		m.windows.pop_back();
+	}
+
+	void* ret = mmap(0, w.length, PROT_READ, m.mmap_flags, m.fd, w.offset);
+	if (ret == MAP_FAILED)
+		throw IOError("Unable to mmap() file window", errno);
+	w.data = static_cast<char*>(ret);
+
+	m.windows.push_front(w);
+	return w.data + (offset - w.offset);
 }
 
-size_t MMAPFile::getpos() const
+void MMAPFile::advise(size_t offset, size_t length, int advice)
+{
+	if (!mapping)
+		throw std::logic_error("Advising closed file");
+	if (offset >= this->length)
+		return;
+	if (offset + length > this->length)
+		length = this->length - offset;
+
+	// madvise() needs page-aligned address
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	if (data)
+	{
+		size_t start = offset & ~(page_size - 1);
+
+		// hints are purely advisory, so ignore failures
+		madvise(data + start, offset + length - start, advice);
+	}
+	else
+	{
+		// advise the windows that are currently mapped
+		for (std::list<Mapping::window>::iterator
+				i = mapping->windows.begin();
+				i != mapping->windows.end(); ++i)
+		{
+			size_t start = std::max(offset, (*i).offset);
+			size_t end = std::min(offset + length,
+					(*i).offset + (*i).length);
+
+			if (start >= end)
+				continue;
+
+			start = (start - (*i).offset) & ~(page_size - 1);
+			end -= (*i).offset;
+			madvise((*i).data + start, end - start, advice);
+		}
+	}
+}
+
+void MMAPFile::set_access_pattern(access_pattern p)
+{
+	int advice;
+#ifdef HAVE_POSIX_FADVISE
+	int fadvice;
+#endif
+
+	switch (p)
+	{
+		case normal:
+			advice = MADV_NORMAL;
+#ifdef HAVE_POSIX_FADVISE
+			fadvice = POSIX_FADV_NORMAL;
+#endif
+			break;
+		case sequential:
+			advice = MADV_SEQUENTIAL;
+#ifdef HAVE_POSIX_FADVISE
+			fadvice = POSIX_FADV_SEQUENTIAL;
+#endif
+			break;
+		case random:
+			advice = MADV_RANDOM;
+#ifdef HAVE_POSIX_FADVISE
+			fadvice = POSIX_FADV_RANDOM;
+#endif
+			break;
+		default:
+			throw std::logic_error("Invalid access pattern");
+	}
+
+	advise(0, length, advice);
+#ifdef HAVE_POSIX_FADVISE
+	// windows mapped later will inherit the readahead setting
+	if (!data)
+		posix_fadvise(mapping->fd, 0, 0, fadvice);
+#endif
+}
+
+void MMAPFile::will_need(size_t offset, size_t length)
 {
+	if (data)
+		advise(offset, length, MADV_WILLNEED);
+#ifdef HAVE_POSIX_FADVISE
+	// the range may not be mapped yet, so prefetch via the fd
+	else if (mapping)
+	{
+		if (offset >= this->length)
+			return;
+		if (offset + length > this->length)
+			length = this->length - offset;
+
+		posix_fadvise(mapping->fd, offset, length, POSIX_FADV_WILLNEED);
+	}
+#endif
+}
+
+void MMAPFile::prefetch(size_t offset, size_t length)
+{
+	if (!mapping)
+		throw std::logic_error("prefetch() for closed file");
+	if (offset >= this->length)
+		return;
+	if (offset + length > this->length)
+		length = this->length - offset;
+
+	// this is purely an optimization, so ignore failures
+#ifdef HAVE_READAHEAD
+	readahead(mapping->fd, offset, length);
+#elif defined(HAVE_POSIX_FADVISE)
+	posix_fadvise(mapping->fd, offset, length, POSIX_FADV_WILLNEED);
+#endif
+}
+
+void MMAPFile::release(size_t offset, size_t length)
+{
+	if (!mapping)
+		throw std::logic_error("release() for closed file");
+	// windows are released by being unmapped
 	if (!data)
+		return;
+	if (offset >= this->length)
+		return;
+	if (offset + length > this->length)
+		length = this->length - offset;
+
+	// we can only release whole pages
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t start = (offset + page_size - 1) & ~(page_size - 1);
+	size_t end = (offset + length) & ~(page_size - 1);
+
+	if (end > start)
+		madvise(data + start, end - start, MADV_DONTNEED);
+}
+
+void MMAPFile::drop_cache(size_t offset, size_t length)
+{
+	if (!mapping)
+		throw std::logic_error("drop_cache() for closed file");
+	if (offset >= this->length)
+		return;
+	if (offset + length > this->length)
+		length = this->length - offset;
+
+	// we can only drop whole pages
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t start = (offset + page_size - 1) & ~(page_size - 1);
+	size_t end = (offset + length) & ~(page_size - 1);
+
+	if (end <= start)
+		return;
+
+	// this is purely advisory, so ignore failures
+	release(start, end - start);
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(mapping->fd, start, end - start, POSIX_FADV_DONTNEED);
+#endif
+}
+
+size_t MMAPFile::getpos() const
+{
+	if (!mapping)
 		throw std::logic_error("getpos() for closed file");
 
-	return (pos - static_cast<char*>(data));
+	return pos;
 }
 
 size_t MMAPFile::getlen() const
@@ -118,35 +361,306 @@ size_t MMAPFile::getlen() const
 
 void MMAPFile::seek(ssize_t offset, std::ios_base::seekdir whence)
 {
-	char* newpos;
+	size_t newpos;
 
-	if (!data)
+	if (!mapping)
 		throw std::logic_error("Seeking closed file");
 
 	switch (whence)
 	{
 		case std::ios::beg:
-			newpos = static_cast<char*>(data);
+			newpos = 0;
 			break;
 		case std::ios::cur:
 			newpos = pos;
 			break;
 		case std::ios::end:
-			newpos = end;
+			newpos = length;
 			break;
 		default:
 			throw std::logic_error("Invalid value for whence");
 	}
 
+	if (offset < 0 && static_cast<size_t>(-offset) > newpos)
+		throw std::runtime_error("Seeking before the beginning of file");
 	newpos += offset;
-	if (newpos > end)
+	if (newpos > length)
 		throw std::runtime_error("EOF while seeking");
 
 	pos = newpos;
 }
 
+static unsigned int thread_count = 0;
+
+void set_thread_count(unsigned int count)
+{
+	thread_count = count;
+}
+
+unsigned int get_thread_count()
+{
+	if (thread_count == 0)
+	{
+		unsigned int cpus = std::thread::hardware_concurrency();
+		return cpus > 0 ? cpus : 1;
+	}
+
+	return thread_count;
+}
+
+// Threads that stay around between the parallel_for() calls, so that
+// the per-thread compressor state (workspaces, contexts) is reused
+class WorkerPool
+{
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	bool stopping;
+
+	// the current job, the number of threads yet to join it
+	// and the number of threads running it
+	const std::function<void()>* job;
+	size_t wanted;
+	size_t running;
+
+	void run();
+
+public:
+	// serializes the users of the pool
+	std::mutex use_mutex;
+
+	WorkerPool();
+	~WorkerPool();
+
+	// run job in the caller and in (up to) helpers pool threads,
+	// and wait for all of them to finish
+	void execute(const std::function<void()>& new_job, size_t helpers);
+};
+
+// set while running a job, so that nested calls run serially
+static thread_local bool in_parallel_for = false;
+
+WorkerPool::WorkerPool()
+	: stopping(false), job(0), wanted(0), running(0)
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+		wake.notify_all();
+	}
+
+	for (std::vector<std::thread>::iterator i = threads.begin();
+			i != threads.end(); ++i)
+		(*i).join();
+}
+
+void WorkerPool::run()
+{
+	in_parallel_for = true;
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (true)
+	{
+		while (!stopping && wanted == 0)
+			wake.wait(lock);
+		if (stopping)
+			break;
+
+		--wanted;
+		++running;
+		const std::function<void()>& current = *job;
+
+		lock.unlock();
+		current();
+		lock.lock();
+
+		if (--running == 0 && wanted == 0)
+			done.notify_one();
+	}
+}
+
+void WorkerPool::execute(const std::function<void()>& new_job,
+		size_t helpers)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (threads.size() < helpers)
+		threads.push_back(std::thread(&WorkerPool::run, this));
+
+	job = &new_job;
+	wanted = helpers;
+	wake.notify_all();
+	lock.unlock();
+
+	in_parallel_for = true;
+	new_job();
+	in_parallel_for = false;
+
+	// the threads that did not get to the job by now are not needed
+	lock.lock();
+	wanted = 0;
+	while (running)
+		done.wait(lock);
+	job = 0;
+}
+
+static WorkerPool worker_pool;
+
+void parallel_for(size_t n, const std::function<void(size_t)>& fn)
+{
+	size_t nthreads = std::min(static_cast<size_t>(get_thread_count()), n);
+
+	if (nthreads <= 1 || in_parallel_for)
+	{
+		for (size_t i = 0; i < n; ++i)
+			fn(i);
+		return;
+	}
+
+	std::atomic<size_t> next(0);
+	std::exception_ptr error;
+	std::mutex error_mutex;
+
+	std::function<void()> worker = [&]()
+	{
+		size_t i;
+
+		while ((i = next.fetch_add(1)) < n)
+		{
+			try
+			{
+				fn(i);
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock(error_mutex);
+				if (!error)
+					error = std::current_exception();
+
+				// stop handing out new items
+				next.store(n);
+			}
+		}
+	};
+
+	{
+		std::lock_guard<std::mutex> lock(worker_pool.use_mutex);
+		worker_pool.execute(worker, nthreads - 1);
+	}
+
+	if (error)
+		std::rethrow_exception(error);
+}
+
+Prefetcher::Prefetcher(const MMAPFile& new_file, size_t new_distance)
+	: f(new_file), distance(new_distance), stopping(false),
+	pos(0), wake_pos(SIZE_MAX)
+{
+}
+
+Prefetcher::~Prefetcher()
+{
+	stop();
+}
+
+void Prefetcher::push(size_t offset, size_t length)
+{
+	if (thread.joinable())
+		throw std::logic_error("Prefetcher already started");
+
+	// merge adjacent (and duplicate) ranges to reduce
+	// the number of syscalls
+	if (!ranges.empty()
+			&& ranges.back().offset + ranges.back().length >= offset)
+	{
+		range& last = ranges.back();
+
+		if (offset + length > last.offset + last.length)
+			last.length = offset + length - last.offset;
+		return;
+	}
+
+	range r;
+	r.offset = offset;
+	r.length = length;
+	ranges.push_back(r);
+}
+
+void Prefetcher::start()
+{
+	if (distance == 0 || ranges.empty())
+		return;
+
+	thread = std::thread(&Prefetcher::run, this);
+}
+
+void Prefetcher::stop()
+{
+	if (!thread.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+		cond.notify_one();
+	}
+
+	thread.join();
+}
+
+void Prefetcher::run()
+{
+	// the max amount of data to read in one call,
+	// to keep the thread responsive to the consumer
+	const size_t max_chunk = std::min(distance / 4 + 1,
+			static_cast<size_t>(1024 * 1024));
+
+	std::vector<range>::iterator i = ranges.begin();
+	size_t done = 0;
+
+	while (i != ranges.end())
+	{
+		size_t limit = pos.load(std::memory_order_relaxed) + distance;
+
+		if ((*i).offset + done >= limit)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+
+			// wake up when the consumer has used half of the data
+			size_t wake = (*i).offset + done - distance / 2;
+			wake_pos.store(wake);
+			while (!stopping && pos.load() < wake)
+				cond.wait(lock);
+			wake_pos.store(SIZE_MAX, std::memory_order_relaxed);
+			if (stopping)
+				break;
+			continue;
+		}
+
+		if (stopping)
+			break;
+
+		size_t length = std::min((*i).length - done, max_chunk);
+		length = std::min(length, limit - (*i).offset - done);
+
+		f.prefetch((*i).offset + done, length);
+
+		done += length;
+		if (done == (*i).length)
+		{
+			++i;
+			done = 0;
+		}
+	}
+}
+
 SparseFileWriter::SparseFileWriter()
-	: offset(0), fd(-1)
+	: offset(0), pending_hole(0), reserved(0), reserve_chunk(0),
+	drop_window(0), drop_start(0), flush_start(0), fd(-1)
 {
 }
 
@@ -156,14 +670,11 @@ SparseFileWriter::~SparseFileWriter()
 		::close(fd);
 }
 
-void SparseFileWriter::open(const char* path, off_t expected_size)
+void SparseFileWriter::open(const char* path)
 {
 	fd = creat(path, 0666);
 	if (fd == -1)
 		throw IOError("Unable to create file", errno);
-
-	if (expected_size > 0)
-		posix_fallocate(fd, 0, expected_size);
 }
 
 void SparseFileWriter::close()
@@ -171,15 +682,99 @@ void SparseFileWriter::close()
 	if (fd == -1)
 		throw std::runtime_error("File is already closed!");
 
+	// extend the file over the trailing hole, and drop any space
+	// preallocated past the data
+	if (pending_hole > 0 || reserved > offset)
+	{
+		if (ftruncate(fd, offset) == -1)
+			throw IOError("ftruncate() failed to set the final file size", errno);
+		pending_hole = 0;
+	}
+
+	if (drop_window > 0)
+		drop_behind(true);
+
 	if (::close(fd) == -1)
 		throw IOError("close() failed", errno);
 	fd = -1;
 }
 
+void SparseFileWriter::flush_hole()
+{
+	// skip all the consecutive holes in one go
+	if (lseek(fd, pending_hole, SEEK_CUR) == -1)
+		throw IOError("lseek() failed to seek past sparse block", errno);
+
+	pending_hole = 0;
+}
+
+void SparseFileWriter::reserve(size_t length)
+{
+	off_t new_reserved = offset + length + reserve_chunk;
+
+	// the reservation is purely an optimization, so ignore failures
+#ifdef HAVE_FALLOCATE
+	// keep the size so that the file can be truncated to the data
+	fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, new_reserved - offset);
+#else
+	posix_fallocate(fd, offset, new_reserved - offset);
+#endif
+
+	reserved = new_reserved;
+}
+
+void SparseFileWriter::preallocate(off_t chunk)
+{
+	reserve_chunk = chunk;
+	reserved = offset;
+}
+
+void SparseFileWriter::drop_cache(off_t window)
+{
+	drop_window = window;
+	drop_start = flush_start = offset;
+}
+
+void SparseFileWriter::drop_behind(bool final)
+{
+	// the pages need to be clean for POSIX_FADV_DONTNEED to drop them.
+	// to avoid stalling on every window, start the writeback of
+	// the recent window and wait only for the previous one.
+#ifdef HAVE_SYNC_FILE_RANGE
+	const unsigned int wait_flags = SYNC_FILE_RANGE_WAIT_BEFORE
+		| SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER;
+
+	if (final)
+		flush_start = offset;
+	else
+		sync_file_range(fd, flush_start, offset - flush_start,
+				SYNC_FILE_RANGE_WRITE);
+
+	sync_file_range(fd, drop_start, flush_start - drop_start, wait_flags);
+#else
+	fdatasync(fd);
+#endif
+
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(fd, drop_start, flush_start - drop_start,
+			POSIX_FADV_DONTNEED);
+#endif
+
+	drop_start = flush_start;
+	flush_start = offset;
+}
+
 void SparseFileWriter::write(const void* data, size_t length)
 {
 	const char* buf = static_cast<const char*>(data);
 
+	if (length == 0)
+		return;
+	if (pending_hole > 0)
+		flush_hole();
+	if (reserve_chunk > 0 && offset + static_cast<off_t>(length) > reserved)
+		reserve(length);
+
 	while (length > 0)
 	{
 		ssize_t ret = ::write(fd, buf, length);
@@ -190,18 +785,15 @@ void SparseFileWriter::write(const void* data, size_t length)
 		buf += ret;
 		offset += ret;
 	}
+
+	if (drop_window > 0 && offset - flush_start >= drop_window)
+		drop_behind(false);
 }
 
 void SparseFileWriter::write_sparse(size_t length)
 {
-	off_t past = offset + length;
-
-	if (ftruncate(fd, past) == -1)
-		throw IOError("ftruncate() failed to extend the sparse file", errno);
-	if (lseek(fd, length, SEEK_CUR) == -1)
-		throw IOError("lseek() failed to seek past sparse block", errno);
-
-	offset = past;
+	pending_hole += length;
+	offset += length;
 }
 
 TemporarySparseFileWriter::TemporarySparseFileWriter()
@@ -218,7 +810,7 @@ TemporarySparseFileWriter::~TemporarySparseFileWriter()
 		unlink(name());
 }
 
-void TemporarySparseFileWriter::open(off_t expected_size)
+void TemporarySparseFileWriter::open()
 {
 	parent_pid = getpid();
 
@@ -226,9 +818,6 @@ void TemporarySparseFileWriter::open(off_t expected_size)
 	fd = mkstemp(buf);
 	if (fd == -1)
 		throw IOError("Unable to create a temporary file", errno);
-
-	if (expected_size > 0)
-		posix_fallocate(fd, 0, expected_size);
 }
 
 const char* TemporarySparseFileWriter::name()
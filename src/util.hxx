@@ -7,10 +7,17 @@
 #ifndef SDT_UTIL_HXX
 #define SDT_UTIL_HXX 1
 
+#include <atomic>
+#include <condition_variable>
 #include <cstdlib> // size_t (maybe take it from somewhere else?)
+#include <functional>
 #include <ios>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
 #ifdef HAVE_CONFIG_H
 #	include "config.h"
@@ -41,6 +48,16 @@ inline uint32_t le_to_host(uint32_t n) { return le32toh(n); }
 template <>
 inline uint64_t le_to_host(uint64_t n) { return le64toh(n); }
 
+// converters from host to LE
+template <class T>
+inline T host_to_le(T n);
+template <>
+inline uint16_t host_to_le(uint16_t n) { return htole16(n); }
+template <>
+inline uint32_t host_to_le(uint32_t n) { return htole32(n); }
+template <>
+inline uint64_t host_to_le(uint64_t n) { return htole64(n); }
+
 // magic auto-conversion types
 template <class T>
 class LittleEndian
@@ -52,6 +69,12 @@ public:
 	{
 		return le_to_host<T>(data);
 	}
+
+	inline LittleEndian& operator=(T n)
+	{
+		data = host_to_le<T>(n);
+		return *this;
+	}
 };
 
 typedef LittleEndian<uint16_t> le16;
@@ -68,23 +91,53 @@ public:
 };
 
 // MMAP-based file reader
+//
+// By default, the whole file is mapped at once. In windowed mode (used
+// when requested, or when the address space is too small to fit the
+// file) only a few windows of the file are mapped at a time, and
+// the pointers returned by peek*()/read*() stay valid only until
+// a few more windows are mapped.
 class MMAPFile
 {
-	int fd;
-	void* data;
-	size_t length;
+	// the state shared by all copies of the file
+	struct Mapping;
 
-	char* pos;
-	char* end;
+	std::shared_ptr<Mapping> mapping;
 
-	void close();
+	// whole-file mapping, or null in windowed mode
+	char* data;
+	size_t length;
+	size_t pos;
+
+	const char* map_window(size_t offset, size_t n);
+	void advise(size_t offset, size_t length, int advice);
 
 public:
+	enum open_flags
+	{
+		// prefault the whole mapping in open()
+		populate = 1 << 0,
+		// ask for transparent huge pages (where supported)
+		huge_pages = 1 << 1
+	};
+
+	enum access_pattern
+	{
+		normal,
+		sequential,
+		random
+	};
+
+	// default window size when falling back to windowed mode
+	static const size_t default_window_size = 64 * 1024 * 1024;
+	// how many windows are kept mapped
+	static const size_t window_count = 4;
+
 	MMAPFile();
-	MMAPFile(const MMAPFile& ref);
-	~MMAPFile();
 
-	void open(const char* path);
+	// window_size = 0 maps the whole file (if possible)
+	void open(const char* path, unsigned int flags = 0,
+			size_t window_size = 0);
 
 	template <class T>
 	const T& peek();
@@ -100,6 +153,16 @@ public:
 	size_t getlen() const;
 	void seek(ssize_t offset,
 			std::ios_base::seekdir whence = std::ios_base::cur);
+
+	// access hints; all of them are advisory
+	void set_access_pattern(access_pattern p);
+	void will_need(size_t offset, size_t length);
+	// read the range into the page cache (blocks until it is read)
+	void prefetch(size_t offset, size_t length);
+	// unmap the given range, keeping it in the page cache
+	void release(size_t offset, size_t length);
+	// drop the given range from the mapping and the page cache
+	void drop_cache(size_t offset, size_t length);
 };
 
 template <class T>
@@ -118,10 +181,11 @@ template <class T>
 const T* MMAPFile::peek_array(size_t n)
 {
 	// ensure we don't run out of data :)
-	if (!pos || pos + sizeof(T) * n > end)
+	if (!mapping || sizeof(T) * n > length - pos)
 		throw std::runtime_error("EOF while reading");
 
-	return static_cast<T*>(static_cast<void*>(pos));
+	const char* ret = data ? data + pos : map_window(pos, sizeof(T) * n);
+	return static_cast<const T*>(static_cast<const void*>(ret));
 }
 
 template <class T>
@@ -132,9 +196,87 @@ const T* MMAPFile::read_array(size_t n)
 	return ret;
 }
 
+// Run fn(0) ... fn(n-1) in parallel threads (the caller and a pool
+// of threads kept between the calls; nested calls run serially).
+// The first exception thrown by fn is rethrown in the caller, after
+// all threads finish.
+void parallel_for(size_t n, const std::function<void(size_t)>& fn);
+
+// set the number of threads used by parallel_for() (0 = CPU count)
+void set_thread_count(unsigned int count);
+unsigned int get_thread_count();
+
+// Background reader that prefetches the known future reads
+// into the page cache, staying up to distance bytes ahead
+// of the consumer. The ranges need to be sorted by offset.
+class Prefetcher
+{
+	struct range
+	{
+		size_t offset;
+		size_t length;
+	};
+
+	MMAPFile f;
+	size_t distance;
+	std::vector<range> ranges;
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::atomic<bool> stopping;
+
+	// current read position of the consumer, and the position
+	// at which the prefetcher needs to be woken up (SIZE_MAX
+	// while it is running)
+	std::atomic<size_t> pos;
+	std::atomic<size_t> wake_pos;
+
+	void run();
+
+public:
+	Prefetcher(const MMAPFile& new_file, size_t new_distance);
+	~Prefetcher();
+
+	void push(size_t offset, size_t length);
+	void start();
+	void stop();
+
+	// report that the consumer has reached given offset
+	void advance(size_t offset);
+};
+
+inline void Prefetcher::advance(size_t offset)
+{
+	// (sequentially consistent, so that either the thread sees
+	// the new position or we see its wake-up position)
+	pos.store(offset);
+
+	// avoid waking up the thread for every block
+	if (offset >= wake_pos.load())
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		cond.notify_one();
+	}
+}
+
 class SparseFileWriter
 {
 	off_t offset;
+	// holes are coalesced and skipped lazily on next write/close
+	off_t pending_hole;
+	// preallocated area end and the step to extend it by
+	off_t reserved;
+	off_t reserve_chunk;
+	// streaming mode: written data whose cache is not dropped yet
+	// and the data whose writeback was started already
+	off_t drop_window;
+	off_t drop_start;
+	off_t flush_start;
+
+	void flush_hole();
+	void reserve(size_t length);
+	void drop_behind(bool final);
 
 public:
 	int fd;
@@ -142,12 +284,21 @@ public:
 	SparseFileWriter();
 	virtual ~SparseFileWriter();
 
-	void open(const char* path, off_t expected_size = 0);
+	void open(const char* path);
 	void close();
 
 	void write(const void* data, size_t length);
 	void write_sparse(size_t length);
 
+	// preallocate the data written from now on in chunks of given size
+	// (0 disables). Use only for dense regions, since the holes
+	// created afterwards would be preallocated as well.
+	void preallocate(off_t chunk);
+
+	// drop the written data from the page cache every window bytes
+	// (0 disables). Useful for huge files that are read only once.
+	void drop_cache(off_t window);
+
 	template <class T>
 	void write(const T& data);
 };
@@ -169,7 +320,7 @@ public:
 	TemporarySparseFileWriter();
 	virtual ~TemporarySparseFileWriter();
 
-	void open(off_t expected_size = 0);
+	void open();
 	void close();
 
 	const char* name();